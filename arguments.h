@@ -21,11 +21,28 @@ struct arguments_t
 
       description.add_options()
          ("help",                                                                      "produce help message")
-         ("input,i",          po::value(&input)->required(),                           "input folder to pack or archive file to unpack")
-         ("output,o",         po::value(&output)->required(),                          "output archive file or folder to unpack")
+         ("input,i",          po::value(&input)->required(),                           "input folder to pack or archive file to unpack, '-' - archive from the standard input")
+         ("output,o",         po::value(&output),                                      "output archive file or folder to unpack, '-' - archive to the standard output")
          ("compression-level,l", po::value(&compression_level)->default_value(0),      "compression level 0..9 (0 - no compression), used only with zstd")
+         ("target-speed",     po::value(&target_speed)->default_value(0),               "input MB/s to keep by moving the level between --min-compression-level and --compression-level (0 - no input target)")
+         ("target-output-speed", po::value(&target_output_speed)->default_value(0),     "archive MB/s to keep the same way, e.g. the write speed of its disk: the level goes up while it is reached (0 - no output target)")
+         ("min-compression-level", po::value(&min_compression_level)->default_value(1), "the lowest level used with --target-speed or --target-output-speed, 1..9")
+         ("chunk-size",       po::value(&chunk_size)->default_value(4096),              "size of independently compressed frame of large files in KB, 64..1048576")
+         ("scan-threads",     po::value(&scan_threads)->default_value(0),               "threads scanning the input folder, more help on network filesystems (0 - auto)")
+         ("max-inflight-bytes", po::value(&max_inflight_bytes)->default_value(uint64_t(1) << 30), "memory budget of file data being packed, files wait for it before they are read; the same again bounds reordering of '-o -' (0 - unlimited)")
+         ("hash-cache",       po::value(&hash_cache),                                  "file keeping digests between runs, unchanged files are not read again")
+         ("hash-engine",      po::value(&hash_engine)->default_value("auto"),           "content hash engine: 'auto','avx2','sse2','scalar'")
+         ("solid-block-size", po::value(&solid_block_size)->default_value(0),           "compress files smaller than a quarter of block together in blocks of this size in KB (0 - off)")
+         ("dictionary-size",  po::value(&dictionary_size)->default_value(0),            "train zstd dictionaries of this size in KB per extension for small files (0 - off)")
+         ("io-engine",        po::value(&io_engine)->default_value("blocking"),         "writer of unpacked files: 'blocking','uring' or 'auto' (io_uring if the kernel supports it)")
+         ("link-mode",        po::value(&link_mode)->default_value("reflink"),          "how duplicates are extracted: 'hardlink','reflink','copy-range','copy', falling back to the following ones")
          ("severity-level,s", po::value(&severity_level)->default_value(lt::warning),  "severity level for output : one of 'trace','debug','info','warning','error','fatal'")
-         ("test-unpack,t",    po::value(&test_unpack)->implicit_value(true),           "unpack archive after packing and compare result with source")
+         ("test-unpack,t",    po::value(&test_unpack)->implicit_value(true),           "verify archive after packing: hash its decompressed entries in memory and compare with source")
+         ("verify-duplicates", po::value(&verify_duplicates)->default_value(true)->implicit_value(true), "byte-compare duplicates found by digest before storing them as links, =false trusts the digest")
+         ("append",           po::value(&append)->implicit_value(true),                "add new and changed files of the input folder to the existing archive")
+         ("list",             po::value(&list)->implicit_value(true),                  "list content of the archive using its index only")
+         ("verify",           po::value(&verify)->implicit_value(true),                "check crc32c of every entry of the archive, no source folder is needed")
+         ("stats-json",       po::value(&stats_json),                                  "write per-phase times, lock waits, queue depths and file size histogram of packing or unpacking to this json file")
          ;
 
       po::variables_map vm;
@@ -41,12 +58,68 @@ struct arguments_t
             return EXIT_SUCCESS;
          }
 
+         if (output.empty() && !list && !verify)
+         {
+            std::cout << "the option '--output' is required but missing" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
+         if (output == "-" && (append || test_unpack))
+         {
+            std::cout << "an archive written to the standard output can't be appended or tested" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
+         if (input == "-" && (list || verify))
+         {
+            std::cout << "an archive read from the standard input can't be listed or verified" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
          if (compression_level > 9 || compression_level < 0)
          {
             std::cout << "compression level must be 0..9" << std::endl;
             std::cout << description;
             return EXIT_FAILURE;
          }
+
+         if (min_compression_level > 9 || min_compression_level < 1)
+         {
+            std::cout << "min compression level must be 1..9" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
+         if (chunk_size > 1048576 || chunk_size < 64)
+         {
+            std::cout << "chunk size must be 64..1048576" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
+         if (io_engine != "auto" && io_engine != "uring" && io_engine != "blocking")
+         {
+            std::cout << "io engine must be one of 'auto','uring','blocking'" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
+         if (link_mode != "hardlink" && link_mode != "reflink" && link_mode != "copy-range" && link_mode != "copy")
+         {
+            std::cout << "link mode must be one of 'hardlink','reflink','copy-range','copy'" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
+
+         if (dictionary_size > 1024)
+         {
+            std::cout << "dictionary size must be 0..1024" << std::endl;
+            std::cout << description;
+            return EXIT_FAILURE;
+         }
       }
       catch (const std::exception& e)
       {
@@ -59,8 +132,25 @@ struct arguments_t
    std::string input;
    std::string output;
    int compression_level = 0;
+   int min_compression_level = 1;
+   size_t target_speed = 0;
+   size_t target_output_speed = 0;
+   size_t chunk_size = 4096;
+   uint64_t max_inflight_bytes = 0;
+   size_t solid_block_size = 0;
+   size_t dictionary_size = 0;
    lt::severity_level severity_level;
    bool test_unpack = false;
+   bool list = false;
+   bool verify = false;
+   bool verify_duplicates = true;
+   std::string hash_engine;
+   std::string hash_cache;
+   std::string stats_json;
+   std::string io_engine;
+   std::string link_mode;
+   bool append = false;
+   unsigned scan_threads = 0;
 };
 
 }
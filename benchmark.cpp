@@ -0,0 +1,471 @@
+// pack/unpack benchmark over generated trees, results are written as json
+//
+// every tree is generated from a fixed seed, so the same build on the same machine measures the same input;
+// runs are made with a warm page cache, the best and the median of the repeated runs are reported
+
+#include "packer.h"
+#include "unpacker.h"
+#include "compress.h"
+#include "utilities.h"
+#include "config.h"
+#include "trace.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+
+namespace bttf {
+
+config_t g_config;
+
+} // namespace bttf
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace chr = std::chrono;
+
+using clock_type = chr::steady_clock;
+
+// kind of content of the generated files
+enum class content_t
+{
+   text,   // words of a small vocabulary, compresses well
+   random  // incompressible
+};
+
+// what a tree is made of; --scale multiplies the number of files, or the size of them for the huge ones
+struct scenario_t
+{
+   const char* name;
+   size_t      files;
+   size_t      file_size;
+   bool        scale_size;
+   content_t   content;
+   double      duplicates;  // share of files repeating the content of an earlier one
+   size_t      depth;       // levels of directories above the files, 0 - all files in the root
+   size_t      fanout;      // files per directory, 0 - all in one
+   bool        chain;       // every next directory is nested in the previous one
+};
+
+const scenario_t Scenarios[] = {
+   { "tiny_files",      20000, 1024,             false, content_t::text,   0.0, 2,  100, false },
+   { "huge_files",      2,     64 * 1024 * 1024, true,  content_t::text,   0.0, 1,  0,   false },
+   { "duplicates_high", 2000,  64 * 1024,        false, content_t::text,   0.9, 1,  100, false },
+   { "duplicates_low",  2000,  64 * 1024,        false, content_t::text,   0.0, 1,  100, false },
+   { "compressible",    64,    1024 * 1024,      false, content_t::text,   0.0, 1,  0,   false },
+   { "incompressible",  64,    1024 * 1024,      false, content_t::random, 0.0, 1,  0,   false },
+   { "deep",            2000,  4096,             false, content_t::text,   0.0, 64, 32,  true  },
+   { "flat",            10000, 4096,             false, content_t::text,   0.0, 0,  0,   false },
+};
+
+struct options_t
+{
+   fs::path    work_dir;
+   std::string output;
+   std::string only;
+   double      scale = 1.0;
+   int         repeat = 3;
+   int         level = 3;
+   bool        keep = false;
+};
+
+// the content depends only on the seed, std distributions are not used since they differ between libraries
+struct generator_t
+{
+   explicit generator_t(uint64_t seed)
+      : rng_(seed)
+   {
+      static const char* words[] = {
+         "archive", "the", "of", "future", "back", "to", "file", "node", "index", "frame", "block", "data",
+         "compress", "level", "stream", "a", "and", "with", "for", "size", "offset", "digest", "link", "tree"
+      };
+      for (auto word : words)
+         words_.push_back(word);
+   }
+
+   std::string make(size_t size, content_t content)
+   {
+      std::string result;
+      result.reserve(size + 16);
+
+      if (content == content_t::random)
+      {
+         while (result.size() < size)
+         {
+            uint64_t v = rng_();
+            result.append(reinterpret_cast<const char*>(&v), sizeof(v));
+         }
+      }
+      else
+      {
+         while (result.size() < size)
+         {
+            result += words_[rng_() % words_.size()];
+            result += (rng_() % 8 == 0) ? '\n' : ' ';
+
+            if (rng_() % 16 == 0)
+               result += std::to_string(rng_() % 100000) + ' ';
+         }
+      }
+
+      result.resize(size);
+      return result;
+   }
+
+   // true with the given probability
+   bool chance(double probability)
+   {
+      return (rng_() >> 11) * (1.0 / (uint64_t(1) << 53)) < probability;
+   }
+
+   uint64_t next() { return rng_(); }
+
+private:
+   std::mt19937_64          rng_;
+   std::vector<std::string> words_;
+};
+
+struct tree_info_t
+{
+   size_t                files = 0;
+   uint64_t              bytes = 0;
+   std::vector<fs::path> paths;
+};
+
+tree_info_t generate_tree(const scenario_t& scenario, const fs::path& root, double scale)
+{
+   tree_info_t info;
+
+   size_t files = scenario.scale_size ? scenario.files : std::max<size_t>(1, size_t(scenario.files * scale));
+   size_t size  = scenario.scale_size ? std::max<size_t>(4096, size_t(scenario.file_size * scale)) : scenario.file_size;
+
+   generator_t generator(bttf::hash_buffer(scenario.name, strlen(scenario.name))[0]);
+   std::vector<std::string> contents;
+
+   fs::remove_all(root);
+   fs::create_directories(root);
+
+   for (size_t i = 0; i < files; ++i)
+   {
+      fs::path dir = root;
+      size_t   group = scenario.fanout ? i / scenario.fanout : 0;
+
+      if (scenario.chain)
+      {
+         // every level of the chain keeps its group of files
+         for (size_t level = 0; level <= std::min(group, scenario.depth - 1); ++level)
+            dir /= "d" + std::to_string(level);
+      }
+      else if (scenario.depth > 0)
+      {
+         dir /= "d" + std::to_string(group);
+         for (size_t level = 1; level < scenario.depth; ++level)
+            dir /= "s" + std::to_string(level);
+      }
+
+      fs::create_directories(dir);
+
+      const std::string* content;
+      std::string        fresh;
+
+      if (!contents.empty() && generator.chance(scenario.duplicates))
+         content = &contents[generator.next() % contents.size()];
+      else
+      {
+         fresh = generator.make(size, scenario.content);
+         if (scenario.duplicates > 0)
+         {
+            contents.push_back(fresh);
+            content = &contents.back();
+         }
+         else
+            content = &fresh;
+      }
+
+      auto path = dir / ("f" + std::to_string(i) + ".dat");
+
+      std::ofstream ofs(path.string(), std::ios::binary);
+      ofs.write(content->data(), content->size());
+      if (!ofs)
+         throw std::runtime_error("can't write " + path.string());
+
+      info.paths.push_back(path);
+      info.bytes += content->size();
+   }
+
+   info.files = files;
+   return info;
+}
+
+uint64_t dir_size(const fs::path& path)
+{
+   uint64_t size = 0;
+   for (const auto& entry : fs::recursive_directory_iterator(path))
+   {
+      if (fs::is_regular_file(entry.status()))
+         size += fs::file_size(entry.path());
+   }
+   return size;
+}
+
+double seconds_since(clock_type::time_point start)
+{
+   return chr::duration<double>(clock_type::now() - start).count();
+}
+
+double percentile(std::vector<double> values, double p)
+{
+   if (values.empty())
+      return 0;
+
+   std::sort(values.begin(), values.end());
+   return values[std::min(values.size() - 1, size_t(p * (values.size() - 1) + 0.5))];
+}
+
+// one line of the results, times of whole runs and of single calls inside the runs
+struct result_t
+{
+   std::string         scenario;
+   std::string         operation;
+   size_t              files = 0;
+   uint64_t            bytes = 0;      // input of the operation
+   uint64_t            out_bytes = 0;  // archive size for pack
+   std::vector<double> runs;           // seconds
+   std::vector<double> calls;          // seconds of every call for per-file operations
+};
+
+std::string to_json(const result_t& r)
+{
+   auto best   = percentile(r.runs, 0);
+   auto median = percentile(r.runs, 0.5);
+
+   std::ostringstream out;
+   out << std::fixed << std::setprecision(6)
+      << "{\"scenario\":\"" << r.scenario << "\",\"operation\":\"" << r.operation << "\""
+      << ",\"files\":" << r.files << ",\"bytes\":" << r.bytes;
+
+   if (r.out_bytes)
+      out << ",\"output_bytes\":" << r.out_bytes;
+
+   out << ",\"runs\":" << r.runs.size()
+      << ",\"seconds_best\":" << best << ",\"seconds_median\":" << median
+      << ",\"mb_per_s\":" << (best > 0 ? r.bytes / best / (1024 * 1024) : 0)
+      << ",\"files_per_s\":" << (best > 0 ? r.files / best : 0);
+
+   if (!r.calls.empty())
+   {
+      out << ",\"latency_us_p50\":" << percentile(r.calls, 0.5) * 1e6
+         << ",\"latency_us_p99\":" << percentile(r.calls, 0.99) * 1e6
+         << ",\"latency_us_max\":" << percentile(r.calls, 1) * 1e6;
+   }
+   out << "}";
+   return out.str();
+}
+
+std::string read_file(const fs::path& path)
+{
+   std::ifstream ifs(path.string(), std::ios::binary);
+   return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+std::vector<result_t> run_scenario(const scenario_t& scenario, const options_t& options)
+{
+   auto tree    = options.work_dir / scenario.name;
+   auto archive = options.work_dir / (std::string(scenario.name) + ".bttf");
+   auto output  = options.work_dir / (std::string(scenario.name) + ".out");
+
+   auto info = generate_tree(scenario, tree, options.scale);
+
+   std::vector<result_t> results;
+
+   auto make_result = [&](const char* operation)
+   {
+      result_t r;
+      r.scenario  = scenario.name;
+      r.operation = operation;
+      r.files     = info.files;
+      r.bytes     = info.bytes;
+      return r;
+   };
+
+   auto pack = make_result("pack");
+   auto unpack = make_result("unpack");
+
+   for (int run = 0; run < options.repeat; ++run)
+   {
+      fs::remove(archive);
+
+      auto start = clock_type::now();
+      {
+         bttf::packer_t packer(tree, archive);
+      }
+      pack.runs.push_back(seconds_since(start));
+      pack.out_bytes = fs::file_size(archive);
+
+      fs::remove_all(output);
+
+      start = clock_type::now();
+      {
+         bttf::unpacker_t unpacker(archive, output);
+      }
+      unpack.runs.push_back(seconds_since(start));
+
+      if (run == 0 && dir_size(output) != info.bytes)
+         throw std::runtime_error(std::string("unpacked tree of ") + scenario.name + " differs from the source");
+   }
+
+   results.push_back(pack);
+   results.push_back(unpack);
+
+   // per-file operations take every file once per run, on one thread
+   auto checksum = make_result("calc_checksum");
+   auto compress = make_result("compress_to_buffer");
+
+   for (int run = 0; run < options.repeat; ++run)
+   {
+      auto start = clock_type::now();
+
+      for (const auto& path : info.paths)
+      {
+         auto call = clock_type::now();
+         bttf::calc_checksum(path);
+         checksum.calls.push_back(seconds_since(call));
+      }
+      checksum.runs.push_back(seconds_since(start));
+
+      double total = 0;
+
+      for (const auto& path : info.paths)
+      {
+         auto content = read_file(path);
+
+         auto call = clock_type::now();
+         auto buffer = bttf::compress_to_buffer(content.data(), content.size(), options.level);
+         auto seconds = seconds_since(call);
+
+         compress.calls.push_back(seconds);
+         total += seconds;
+         compress.out_bytes += run == 0 ? buffer.size() : 0;
+      }
+      compress.runs.push_back(total);
+   }
+
+   results.push_back(checksum);
+   results.push_back(compress);
+
+   if (!options.keep)
+   {
+      fs::remove_all(tree);
+      fs::remove_all(output);
+      fs::remove(archive);
+   }
+   return results;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+   namespace po = boost::program_options;
+
+   options_t options;
+   std::string work_dir;
+
+   po::options_description description("BackToTheFuture benchmark. Allowed options");
+
+   description.add_options()
+      ("help",                                                                         "produce help message")
+      ("work-dir",          po::value(&work_dir),                                      "folder for generated trees and archives (default - temp folder)")
+      ("output,o",          po::value(&options.output),                                "json file of the results (default - standard output)")
+      ("scenario",          po::value(&options.only),                                  "run only the scenario of this name")
+      ("scale",             po::value(&options.scale)->default_value(1.0),             "multiplier of file counts of the scenarios")
+      ("repeat",            po::value(&options.repeat)->default_value(3),              "runs of every operation, the best and the median are reported")
+      ("compression-level,l", po::value(&options.level)->default_value(3),             "compression level 0..9 used by pack and compress_to_buffer")
+      ("keep",              po::value(&options.keep)->implicit_value(true),            "keep generated trees and archives")
+      ;
+
+   po::variables_map vm;
+
+   try
+   {
+      po::store(po::parse_command_line(argc, argv, description), vm);
+      po::notify(vm);
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << e.what() << std::endl << description;
+      return EXIT_FAILURE;
+   }
+
+   if (vm.count("help"))
+   {
+      std::cout << description;
+      return EXIT_SUCCESS;
+   }
+
+   if (options.repeat < 1 || options.scale <= 0 || options.level < 0 || options.level > 9)
+   {
+      std::cerr << "repeat must be positive, scale must be above 0, compression level must be 0..9" << std::endl << description;
+      return EXIT_FAILURE;
+   }
+
+   options.work_dir = work_dir.empty() ? fs::temp_directory_path() / ("bttf-benchmark-" + bttf::make_uuid()) : fs::path(work_dir);
+
+   // the defaults of the command line tool, only the level is chosen
+   bttf::g_config.severity_level = boost::log::trivial::warning;
+   bttf::g_config.compression_level = options.level;
+
+   std::vector<std::string> lines;
+
+   try
+   {
+      fs::create_directories(options.work_dir);
+
+      for (const auto& scenario : Scenarios)
+      {
+         if (!options.only.empty() && options.only != scenario.name)
+            continue;
+
+         std::cerr << "running " << scenario.name << "..." << std::endl;
+
+         for (const auto& result : run_scenario(scenario, options))
+            lines.push_back(to_json(result));
+      }
+
+      if (!options.keep && work_dir.empty())
+         fs::remove_all(options.work_dir);
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "benchmark failed: " << e.what() << std::endl;
+      return EXIT_FAILURE;
+   }
+
+   std::ostringstream json;
+   json << "{\"benchmark\":\"bttf\",\"format_version\":" << bttf::FormatVersion
+      << ",\"scale\":" << options.scale << ",\"repeat\":" << options.repeat << ",\"compression_level\":" << options.level
+      << ",\"results\":[\n";
+
+   for (size_t i = 0; i < lines.size(); ++i)
+      json << "  " << lines[i] << (i + 1 < lines.size() ? ",\n" : "\n");
+
+   json << "]}\n";
+
+   if (options.output.empty())
+      std::cout << json.str();
+   else
+      std::ofstream(options.output) << json.str();
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace bttf {
+
+namespace {
+
+const size_t MaxPooledBuffers = 64;
+const size_t MaxPooledBytes   = 256 * 1024 * 1024;
+
+struct buffer_pool_t
+{
+   // the smallest free storage big enough, otherwise the biggest one to grow
+   std::vector<char> take(size_t size)
+   {
+      std::vector<char> storage;
+
+      if (size == 0)
+         return storage;
+
+      {
+         std::unique_lock<std::mutex> _(mut);
+
+         auto fits    = free.end();
+         auto biggest = free.end();
+
+         for (auto iter = free.begin(); iter != free.end(); ++iter)
+         {
+            if (iter->size() >= size && (fits == free.end() || iter->size() < fits->size()))
+               fits = iter;
+
+            if (biggest == free.end() || iter->size() > biggest->size())
+               biggest = iter;
+         }
+
+         auto best = fits != free.end() ? fits : biggest;
+
+         if (best != free.end())
+         {
+            pooled_bytes -= best->size();
+            storage = std::move(*best);
+            free.erase(best);
+         }
+      }
+
+      if (storage.size() >= size)
+         ++reuses;
+      else
+         grow(storage, size);
+
+      return storage;
+   }
+
+   void give(std::vector<char>&& storage)
+   {
+      if (storage.empty())
+         return;
+
+      std::unique_lock<std::mutex> _(mut);
+
+      if (free.size() < MaxPooledBuffers && pooled_bytes + storage.size() <= MaxPooledBytes)
+      {
+         pooled_bytes += storage.size();
+         free.push_back(std::move(storage));
+      }
+   }
+
+   void grow(std::vector<char>& storage, size_t size)
+   {
+      if (size > storage.size())
+      {
+         storage.resize(size);
+         ++allocations;
+      }
+   }
+
+   std::mutex mut;
+   std::vector<std::vector<char>> free;
+   size_t pooled_bytes = 0;
+
+   std::atomic<size_t> allocations = 0;
+   std::atomic<size_t> reuses = 0;
+};
+
+buffer_pool_t& pool()
+{
+   static buffer_pool_t pool;
+   return pool;
+}
+
+} // namespace
+
+buffer_t::buffer_t(size_t size)
+   : storage_(pool().take(size))
+   , size_(size)
+{
+}
+
+buffer_t::buffer_t(buffer_t&& other) noexcept
+   : storage_(std::move(other.storage_))
+   , size_(other.size_)
+{
+   other.size_ = 0;
+}
+
+buffer_t& buffer_t::operator=(buffer_t&& other) noexcept
+{
+   if (this != &other)
+   {
+      release();
+      storage_ = std::move(other.storage_);
+      size_ = other.size_;
+      other.size_ = 0;
+   }
+   return *this;
+}
+
+buffer_t::~buffer_t()
+{
+   release();
+}
+
+void buffer_t::resize(size_t size)
+{
+   pool().grow(storage_, size);
+   size_ = size;
+}
+
+void buffer_t::release()
+{
+   pool().give(std::move(storage_));
+   storage_ = std::vector<char>();
+   size_ = 0;
+}
+
+buffer_pool_stats_t buffer_pool_stats()
+{
+   buffer_pool_stats_t stats;
+   stats.allocations = pool().allocations;
+   stats.reuses      = pool().reuses;
+   return stats;
+}
+
+} // namespace bttf
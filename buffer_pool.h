@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+namespace bttf {
+
+// memory taken from the shared pool and given back to it on destruction,
+// a reused storage is not allocated and zero-filled again
+struct buffer_t
+{
+   buffer_t() = default;
+   explicit buffer_t(size_t size);
+
+   buffer_t(buffer_t&& other) noexcept;
+   buffer_t& operator=(buffer_t&& other) noexcept;
+
+   buffer_t(const buffer_t&) = delete;
+   buffer_t& operator=(const buffer_t&) = delete;
+
+   ~buffer_t();
+
+   char*       data()       { return storage_.data(); }
+   const char* data() const { return storage_.data(); }
+
+   size_t size() const  { return size_; }
+   bool   empty() const { return size_ == 0; }
+
+   // keeps the content, the storage grows only if it is too small
+   void resize(size_t size);
+
+private:
+   void release();
+
+private:
+   std::vector<char> storage_;
+   size_t            size_ = 0;
+};
+
+struct buffer_pool_stats_t
+{
+   size_t allocations = 0; // storages allocated or grown
+   size_t reuses = 0;      // storages taken from the pool
+};
+
+buffer_pool_stats_t buffer_pool_stats();
+
+} // namespace bttf
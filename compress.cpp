@@ -1,24 +1,211 @@
+#include "compress.h"
 #include "trace.h"
 
 #include <boost/noncopyable.hpp>
-#include <boost/filesystem/path.hpp>
-#include <boost/filesystem/fstream.hpp>
 
-namespace fs = boost::filesystem;
+#include <atomic>
+#include <array>
+#include <cmath>
+#include <cstring>
 
 #if USE_ZSTD
 
 #include <zstd.h>
+#include <zdict.h>
 
 namespace bttf {
 
-std::vector<char> compress_to_buffer(const void* data, size_t size, int compression_level)
+dictionary_t::dictionary_t(const void* data, size_t size, int compression_level)
+   : content_(static_cast<const char*>(data), static_cast<const char*>(data) + size)
+{
+   if (compression_level > 0)
+      cdict_ = ZSTD_createCDict(content_.data(), content_.size(), compression_level);
+
+   ddict_ = ZSTD_createDDict(content_.data(), content_.size());
+
+   if ((compression_level > 0 && !cdict_) || !ddict_)
+   {
+      ZSTD_freeCDict(cdict_);
+      ZSTD_freeDDict(ddict_);
+      throw std::runtime_error("zstd dictionary can't be loaded");
+   }
+}
+
+dictionary_t::~dictionary_t()
+{
+   ZSTD_freeCDict(cdict_);
+   ZSTD_freeDDict(ddict_);
+}
+
+unsigned dictionary_t::id() const
+{
+   return ZSTD_getDictID_fromDDict(ddict_);
+}
+
+std::vector<char> train_dictionary(const std::vector<char>& samples, const std::vector<size_t>& sample_sizes, size_t dictionary_size)
+{
+   std::vector<char> buffer(dictionary_size);
+
+   size_t res = ZDICT_trainFromBuffer(buffer.data(), buffer.size(), samples.data(), sample_sizes.data(), static_cast<unsigned>(sample_sizes.size()));
+
+   if (ZDICT_isError(res))
+   {
+      BTTF_DEBUG() << "zstd dictionary training failed :" << ZDICT_getErrorName(res);
+      return {};
+   }
+   buffer.resize(res);
+   return buffer;
+}
+
+unsigned frame_dictionary_id(const void* data, size_t size)
+{
+   return ZSTD_getDictID_fromFrame(data, size);
+}
+
+boost::optional<uint64_t> frame_content_size(const void* data, size_t size)
+{
+   auto res = ZSTD_getFrameContentSize(data, size);
+
+   if (res == ZSTD_CONTENTSIZE_UNKNOWN || res == ZSTD_CONTENTSIZE_ERROR)
+      return boost::none;
+
+   return static_cast<uint64_t>(res);
+}
+
+static std::atomic<size_t> contexts = 0;
+
+struct zstd_cctx : boost::noncopyable
+{
+   zstd_cctx()
+      : c(ZSTD_createCCtx())
+   {
+      if (!c)
+         throw std::runtime_error("zstd compression context can't be created");
+      ++contexts;
+   }
+
+   ~zstd_cctx()
+   {
+      ZSTD_freeCCtx(c);
+   }
+
+   ZSTD_CCtx* c;
+};
+
+struct zstd_dctx : boost::noncopyable
+{
+   zstd_dctx()
+      : c(ZSTD_createDCtx())
+   {
+      if (!c)
+         throw std::runtime_error("zstd decompression context can't be created");
+      ++contexts;
+   }
+
+   ~zstd_dctx()
+   {
+      ZSTD_freeDCtx(c);
+   }
+
+   ZSTD_DCtx* c;
+};
+
+// contexts are reused by all files handled by the thread
+static ZSTD_CCtx* thread_cctx()
+{
+   thread_local zstd_cctx ctx;
+   return ctx.c;
+}
+
+static ZSTD_DCtx* thread_dctx(const dictionary_t* dictionary = nullptr)
+{
+   thread_local zstd_dctx ctx;
+
+   ZSTD_DCtx_reset(ctx.c, ZSTD_reset_session_and_parameters);
+
+   if (dictionary)
+      ZSTD_DCtx_refDDict(ctx.c, dictionary->ddict());
+
+   return ctx.c;
+}
+
+size_t compression_contexts()
+{
+   return contexts;
+}
+
+// samples spread over the data, smaller data is examined as a whole
+static const size_t EntropySamples    = 8;
+static const size_t EntropySampleSize = 4096;
+
+// bits per byte, random and already compressed data are close to 8
+static const double MaxSampleEntropy  = 7.9;
+
+// the trial has to save at least 3% of the samples
+static const double MaxTrialRatio     = 0.97;
+
+static double byte_entropy(const std::array<size_t, 256>& histogram, size_t total)
+{
+   double entropy = 0;
+
+   for (auto count : histogram)
+   {
+      if (count > 0)
+      {
+         double p = double(count) / total;
+         entropy -= p * std::log2(p);
+      }
+   }
+   return entropy;
+}
+
+bool is_compressible(const void* data, size_t size)
+{
+   if (size == 0)
+      return false;
+
+   auto src = static_cast<const char*>(data);
+
+   buffer_t samples(std::min(size, EntropySamples * EntropySampleSize));
+
+   if (samples.size() == size)
+      memcpy(samples.data(), src, size);
+   else
+   {
+      auto step = (size - EntropySampleSize) / (EntropySamples - 1);
+
+      for (size_t i = 0; i < EntropySamples; ++i)
+         memcpy(samples.data() + i * EntropySampleSize, src + i * step, EntropySampleSize);
+   }
+
+   std::array<size_t, 256> histogram = {};
+
+   for (size_t i = 0; i < samples.size(); ++i)
+      ++histogram[static_cast<unsigned char>(samples.data()[i])];
+
+   if (byte_entropy(histogram, samples.size()) < MaxSampleEntropy)
+      return true;
+
+   // flat byte distribution may still have long repeats, the fastest level finds them
+   buffer_t trial(ZSTD_compressBound(samples.size()));
+
+   size_t res = ZSTD_compressCCtx(thread_cctx(), trial.data(), trial.size(), samples.data(), samples.size(), 1);
+
+   return !ZSTD_isError(res) && res < samples.size() * MaxTrialRatio;
+}
+
+buffer_t compress_to_buffer(const void* data, size_t size, int compression_level, const dictionary_t* dictionary)
 {
    size_t bound = ZSTD_compressBound(size);
 
-   std::vector<char> buffer(bound);
+   buffer_t buffer(bound);
 
-   size_t res = ZSTD_compress(buffer.data(), bound, data, size, compression_level);
+   size_t res;
+
+   if (dictionary)
+      res = ZSTD_compress_usingCDict(thread_cctx(), buffer.data(), bound, data, size, dictionary->cdict());
+   else
+      res = ZSTD_compressCCtx(thread_cctx(), buffer.data(), bound, data, size, compression_level);
 
    if (ZSTD_isError(res))
    {
@@ -32,46 +219,48 @@ std::vector<char> compress_to_buffer(const void* data, size_t size, int compress
    return {};
 }
 
-struct zstd_dstream : boost::noncopyable
+size_t compress_bound(size_t size)
 {
-   zstd_dstream()
-      : c(ZSTD_createDStream())
-   {
-   }
+   return ZSTD_compressBound(size);
+}
 
-   size_t init()
-   {
-      return ZSTD_initDStream(c);
-   }
+buffer_t compress_frame(const void* data, size_t size, int compression_level)
+{
+   buffer_t buffer(ZSTD_compressBound(size));
 
-   ~zstd_dstream()
-   {
-      ZSTD_freeDStream(c);
-   }
+   size_t res = ZSTD_compressCCtx(thread_cctx(), buffer.data(), buffer.size(), data, size, compression_level);
 
-   ZSTD_DStream* c;
-};
+   if (ZSTD_isError(res))
+      throw std::runtime_error(std::string("zstd compress failed : ") + ZSTD_getErrorName(res));
 
-bool uncompress_to_file(const void* data, size_t data_size, const fs::path& path)
+   buffer.resize(res);
+   return buffer;
+}
+
+bool uncompress_to_memory(const void* data, size_t data_size, void* dst, size_t dst_size, const dictionary_t* dictionary)
 {
-   zstd_dstream ctx;
-   ctx.init();
+   size_t res = ZSTD_decompressDCtx(thread_dctx(dictionary), dst, dst_size, data, data_size);
 
-   auto is = ZSTD_DStreamInSize();
-   auto os = ZSTD_DStreamOutSize();
+   if (ZSTD_isError(res))
+   {
+      BTTF_ERROR() << "uncompress frame failed : " << ZSTD_getErrorName(res);
+      return false;
+   }
+   return res == dst_size;
+}
 
-   std::vector<char> buffer(os);
+bool uncompress_to_stream(const void* data, size_t data_size, const uncompress_sink_t& sink, const dictionary_t* dictionary)
+{
+   auto ctx = thread_dctx(dictionary);
+
+   buffer_t buffer(ZSTD_DStreamOutSize());
 
    ZSTD_outBuffer out{ buffer.data(),  buffer.size(), 0 };
    ZSTD_inBuffer  in { data,           data_size,     0 };
 
-   fs::ofstream ofs;
-   ofs.exceptions(std::ofstream::badbit);
-   ofs.open(path, std::ios::binary);
-
    for (;;)
    {
-      auto res = ZSTD_decompressStream(ctx.c, &out, &in);
+      auto res = ZSTD_decompressStream(ctx, &out, &in);
 
       if (ZSTD_isError(res))
       {
@@ -81,7 +270,7 @@ bool uncompress_to_file(const void* data, size_t data_size, const fs::path& path
 
       if (out.pos > 0)
       {
-         ofs.write(static_cast<const char*>(out.dst), out.pos);
+         sink(static_cast<const char*>(out.dst), out.pos);
          if (out.pos == out.size)
          {
             out.pos = 0;
@@ -102,13 +291,88 @@ bool uncompress_to_file(const void* data, size_t data_size, const fs::path& path
    }
 }
 
+stream_decompressor_t::stream_decompressor_t(const dictionary_t* dictionary)
+   : ctx_(ZSTD_createDCtx())
+   , out_(ZSTD_DStreamOutSize())
+{
+   if (!ctx_)
+      throw std::runtime_error("zstd decompression context can't be created");
+
+   if (dictionary)
+      ZSTD_DCtx_refDDict(ctx_, dictionary->ddict());
+}
+
+stream_decompressor_t::~stream_decompressor_t()
+{
+   ZSTD_freeDCtx(ctx_);
+}
+
+bool stream_decompressor_t::feed(const void* data, size_t size, const uncompress_sink_t& sink)
+{
+   ZSTD_inBuffer in{ data, size, 0 };
+
+   // the output may be left full while the input is consumed, so it is drained till it is not full
+   for (;;)
+   {
+      ZSTD_outBuffer out{ out_.data(), out_.size(), 0 };
+
+      auto res = ZSTD_decompressStream(ctx_, &out, &in);
+
+      if (ZSTD_isError(res))
+      {
+         BTTF_ERROR() << "uncompress stream failed : " << ZSTD_getErrorName(res);
+         return false;
+      }
+
+      if (out.pos > 0)
+         sink(out_.data(), out.pos);
+
+      if (in.pos == in.size && out.pos < out.size)
+         return true;
+   }
+}
+
 } // namespace bttf
 
 #else // !USE_ZSTD
 
 namespace bttf {
 
-std::vector<char> compress_to_buffer(const void* data, size_t size, int compression_level)
+dictionary_t::dictionary_t(const void* data, size_t size, int compression_level)
+{
+   throw std::runtime_error("dictionaries are not supported; rebuild with ZSTD");
+}
+
+dictionary_t::~dictionary_t()
+{
+}
+
+unsigned dictionary_t::id() const
+{
+   return 0;
+}
+
+std::vector<char> train_dictionary(const std::vector<char>& samples, const std::vector<size_t>& sample_sizes, size_t dictionary_size)
+{
+   return {};
+}
+
+unsigned frame_dictionary_id(const void* data, size_t size)
+{
+   return 0;
+}
+
+boost::optional<uint64_t> frame_content_size(const void* data, size_t size)
+{
+   return boost::none;
+}
+
+bool is_compressible(const void* data, size_t size)
+{
+   return true;
+}
+
+buffer_t compress_to_buffer(const void* data, size_t size, int compression_level, const dictionary_t* dictionary)
 {
    static bool once = []
    {
@@ -119,7 +383,7 @@ std::vector<char> compress_to_buffer(const void* data, size_t size, int compress
    return {};
 }
 
-bool uncompress_to_file(const void* data, size_t data_size, const fs::path& path)
+bool uncompress_to_stream(const void* data, size_t data_size, const uncompress_sink_t& sink, const dictionary_t* dictionary)
 {
    static bool once = []
    {
@@ -130,6 +394,46 @@ bool uncompress_to_file(const void* data, size_t data_size, const fs::path& path
    return false;
 }
 
+size_t compress_bound(size_t size)
+{
+   return 0;
+}
+
+buffer_t compress_frame(const void* data, size_t size, int compression_level)
+{
+   throw std::runtime_error("compressing is not supported; rebuild with ZSTD");
+}
+
+bool uncompress_to_memory(const void* data, size_t data_size, void* dst, size_t dst_size, const dictionary_t* dictionary)
+{
+   static bool once = []
+   {
+      BTTF_ERROR() << "decompressing is not supported; rebuild with ZSTD";
+      return true;
+   }();
+
+   return false;
+}
+
+size_t compression_contexts()
+{
+   return 0;
+}
+
+stream_decompressor_t::stream_decompressor_t(const dictionary_t* dictionary)
+{
+   throw std::runtime_error("decompressing is not supported; rebuild with ZSTD");
+}
+
+stream_decompressor_t::~stream_decompressor_t()
+{
+}
+
+bool stream_decompressor_t::feed(const void* data, size_t size, const uncompress_sink_t& sink)
+{
+   return false;
+}
+
 } // namespace bttf
 
 #endif 
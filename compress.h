@@ -1,11 +1,86 @@
 #pragma once
 
-#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+
+#include "buffer_pool.h"
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+struct ZSTD_DCtx_s;
 
 namespace bttf {
 
-std::vector<char> compress_to_buffer(const void* data, size_t size, int compression_level);
+// trained zstd dictionary, digested once and shared by all threads
+struct dictionary_t : boost::noncopyable
+{
+   // the compression dictionary is prepared only for compression_level > 0
+   dictionary_t(const void* data, size_t size, int compression_level = 0);
+   ~dictionary_t();
+
+   unsigned id() const;
+
+   const std::vector<char>& content() const { return content_; }
+
+   ZSTD_CDict_s* cdict() const { return cdict_; }
+   ZSTD_DDict_s* ddict() const { return ddict_; }
+
+private:
+   std::vector<char> content_;
+   ZSTD_CDict_s*     cdict_ = nullptr;
+   ZSTD_DDict_s*     ddict_ = nullptr;
+};
+
+using dictionary_ptr = std::shared_ptr<dictionary_t>;
+
+// samples are concatenated in one buffer, returns empty buffer if training fails
+std::vector<char> train_dictionary(const std::vector<char>& samples, const std::vector<size_t>& sample_sizes, size_t dictionary_size);
+
+// id of the dictionary the frame is compressed with, 0 - none
+unsigned frame_dictionary_id(const void* data, size_t size);
+
+// cheap estimate from a few sampled blocks: byte entropy and a fast trial compression;
+// false means compressing the whole data is very unlikely to make it smaller
+bool is_compressible(const void* data, size_t size);
+
+buffer_t compress_to_buffer(const void* data, size_t size, int compression_level, const dictionary_t* dictionary = nullptr);
+
+// the biggest buffer compressing of the size may take
+size_t compress_bound(size_t size);
+
+// decompressed data is handed to the sink piece by piece
+using uncompress_sink_t = std::function<void(const char* data, size_t size)>;
+
+bool uncompress_to_stream(const void* data, size_t data_size, const uncompress_sink_t& sink, const dictionary_t* dictionary = nullptr);
+
+// decompresses one frame handed over piece by piece, for data read from a stream
+struct stream_decompressor_t : boost::noncopyable
+{
+   explicit stream_decompressor_t(const dictionary_t* dictionary = nullptr);
+   ~stream_decompressor_t();
+
+   // false if the data is broken
+   bool feed(const void* data, size_t size, const uncompress_sink_t& sink);
+
+private:
+   ZSTD_DCtx_s* ctx_ = nullptr;
+   buffer_t     out_;
+};
+
+// compresses one independent frame, the result may be bigger than the source
+buffer_t compress_frame(const void* data, size_t size, int compression_level);
+
+// decompresses one frame into the buffer of exactly known original size
+bool uncompress_to_memory(const void* data, size_t data_size, void* dst, size_t dst_size, const dictionary_t* dictionary = nullptr);
+
+// original size kept in the frame header, none if it is not known
+boost::optional<uint64_t> frame_content_size(const void* data, size_t size);
 
-bool uncompress_to_file(const void* data, size_t data_size, const boost::filesystem::path& path);
+// zstd contexts created so far, every thread keeps one for compression and one for decompression
+size_t compression_contexts();
 
 } // namespace bttf
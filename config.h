@@ -3,12 +3,28 @@
 #include <boost/log/trivial.hpp>
 #include <boost/filesystem/path.hpp>
 
+#include <string>
+
 namespace bttf {
 
 struct config_t
 {
    boost::log::trivial::severity_level severity_level;
-   int compression_level = 0;
+   int compression_level = 0;           // the highest level when the adaptive level is on
+   int min_compression_level = 1;       // the lowest level the adaptive level goes down to
+   uint64_t target_speed = 0;           // input bytes per second the adaptive level keeps, 0 - no input target
+   uint64_t target_output_speed = 0;    // archive bytes per second the adaptive level keeps, 0 - no output target
+   bool verify_duplicates = true;       // byte-compare files of the same digest before linking them
+   size_t chunk_size = 4 * 1024 * 1024; // files bigger than this are compressed as independent frames
+   boost::filesystem::path hash_cache;  // digests of unchanged files are taken from here
+   bool append = false;                 // add new and changed files to the existing archive
+   size_t solid_block_size = 0;         // small files are compressed together in blocks of this size, 0 - off
+   size_t dictionary_size = 0;          // size of zstd dictionaries trained per extension for small files, 0 - off
+   std::string link_mode = "reflink";   // how other names of a file are made: "hardlink", "reflink", "copy-range", "copy"
+   std::string io_engine = "blocking";  // writer of unpacked files: "auto", "uring" or "blocking"
+   unsigned scan_threads = 0;           // threads scanning the input folder, 0 - depends on cpu count
+   uint64_t max_inflight_bytes = uint64_t(1) << 30; // file data read and not written yet by the packer, 0 - unlimited
+   boost::filesystem::path stats_json;  // the counters of the run are written here, empty - not written
 };
 
 extern config_t g_config;
@@ -0,0 +1,193 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BTTF_CRC_X64 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define BTTF_CRC_X64 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BTTF_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define BTTF_TARGET_SSE42
+#endif
+
+namespace bttf {
+
+namespace {
+
+const uint32_t Poly = 0x82F63B78; // reflected Castagnoli polynomial
+
+struct tables_t
+{
+   tables_t()
+   {
+      for (uint32_t i = 0; i < 256; ++i)
+      {
+         uint32_t crc = i;
+         for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (Poly & (0 - (crc & 1)));
+         words[0][i] = crc;
+      }
+
+      // table k gives the crc of a byte followed by k zero bytes
+      for (uint32_t i = 0; i < 256; ++i)
+      {
+         for (int k = 1; k < 8; ++k)
+            words[k][i] = (words[k - 1][i] >> 8) ^ words[0][words[k - 1][i] & 0xFF];
+      }
+   }
+
+   uint32_t words[8][256];
+};
+
+const tables_t tables;
+
+uint32_t update_slice8(uint32_t crc, const char* data, size_t size)
+{
+   auto p = reinterpret_cast<const unsigned char*>(data);
+
+   for (; size >= 8; size -= 8, p += 8)
+   {
+      uint32_t lo;
+      uint32_t hi;
+      memcpy(&lo, p, sizeof(lo));
+      memcpy(&hi, p + 4, sizeof(hi));
+      lo ^= crc;
+
+      crc = tables.words[7][lo & 0xFF] ^ tables.words[6][(lo >> 8) & 0xFF] ^ tables.words[5][(lo >> 16) & 0xFF] ^ tables.words[4][lo >> 24]
+          ^ tables.words[3][hi & 0xFF] ^ tables.words[2][(hi >> 8) & 0xFF] ^ tables.words[1][(hi >> 16) & 0xFF] ^ tables.words[0][hi >> 24];
+   }
+
+   for (; size > 0; --size, ++p)
+      crc = (crc >> 8) ^ tables.words[0][(crc ^ *p) & 0xFF];
+
+   return crc;
+}
+
+#if BTTF_CRC_X64
+
+BTTF_TARGET_SSE42 uint32_t update_sse42(uint32_t crc, const char* data, size_t size)
+{
+   uint64_t crc64 = crc;
+
+   for (; size >= 8; size -= 8, data += 8)
+   {
+      uint64_t v;
+      memcpy(&v, data, sizeof(v));
+      crc64 = _mm_crc32_u64(crc64, v);
+   }
+
+   crc = static_cast<uint32_t>(crc64);
+
+   for (; size > 0; --size, ++data)
+      crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+
+   return crc;
+}
+
+bool cpu_has_sse42()
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return __builtin_cpu_supports("sse4.2");
+#elif defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 1);
+   return (info[2] & (1 << 20)) != 0;
+#else
+   return false;
+#endif
+}
+
+#endif // BTTF_CRC_X64
+
+struct crc_engine_t
+{
+   const char* name;
+   uint32_t (*update)(uint32_t crc, const char* data, size_t size);
+};
+
+crc_engine_t detect_engine()
+{
+#if BTTF_CRC_X64
+   if (cpu_has_sse42())
+      return { "sse4.2", update_sse42 };
+#endif
+   return { "slice-by-8", update_slice8 };
+}
+
+const crc_engine_t g_engine = detect_engine();
+
+// the crc of zero bits appended to the data is a linear function of the crc, it is a 32x32 matrix over GF(2)
+uint32_t gf2_times(const uint32_t* mat, uint32_t vec)
+{
+   uint32_t sum = 0;
+   for (; vec; vec >>= 1, ++mat)
+   {
+      if (vec & 1)
+         sum ^= *mat;
+   }
+   return sum;
+}
+
+void gf2_square(uint32_t* square, const uint32_t* mat)
+{
+   for (int n = 0; n < 32; ++n)
+      square[n] = gf2_times(mat, mat[n]);
+}
+
+} // namespace
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc)
+{
+   return ~g_engine.update(~crc, static_cast<const char*>(data), size);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+   if (size2 == 0)
+      return crc1;
+
+   uint32_t even[32];
+   uint32_t odd[32];
+
+   // operator for one zero bit
+   odd[0] = Poly;
+   for (uint32_t n = 1, row = 1; n < 32; ++n, row <<= 1)
+      odd[n] = row;
+
+   gf2_square(even, odd); // two zero bits
+   gf2_square(odd, even); // four zero bits
+
+   // every pass squares the operator for the next bit of the size in bytes
+   do
+   {
+      gf2_square(even, odd);
+      if (size2 & 1)
+         crc1 = gf2_times(even, crc1);
+      size2 >>= 1;
+
+      if (size2 == 0)
+         break;
+
+      gf2_square(odd, even);
+      if (size2 & 1)
+         crc1 = gf2_times(odd, crc1);
+      size2 >>= 1;
+   } while (size2 != 0);
+
+   return crc1 ^ crc2;
+}
+
+const char* crc32c_engine_name()
+{
+   return g_engine.name;
+}
+
+} // namespace bttf
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace bttf {
+
+// CRC32C (Castagnoli), crc is the checksum of the preceding data to continue it;
+// the sse4.2 instruction is used if the cpu has it, slice-by-8 tables otherwise
+uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+// checksum of two consecutive pieces made of the checksums of both and the size of the second one
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+// "sse4.2" or "slice-by-8"
+const char* crc32c_engine_name();
+
+} // namespace bttf
@@ -0,0 +1,515 @@
+#include "file_writer.h"
+#include "trace.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RSRC_REGISTER_SPARSE)
+#define BTTF_IO_URING 1
+#endif
+#endif
+#endif
+
+#if BTTF_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace bttf {
+
+static void write_blocking(const output_tree_t& tree, const output_entry_t& entry, const char* data, size_t size)
+{
+   try
+   {
+      output_handle_t file(tree, entry);
+      file.write(data, size);
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while writing the file " << tree.path(entry) << ", :" << e.what();
+   }
+}
+
+namespace {
+
+struct blocking_writer_t : file_writer_t
+{
+   explicit blocking_writer_t(const output_tree_t& tree)
+      : tree_(tree)
+   {
+   }
+
+   void write(const output_entry_t& entry, const char* data, size_t size, std::shared_ptr<const void> /*keep*/) override
+   {
+      write_blocking(tree_, entry, data, size);
+   }
+
+   void flush() override
+   {
+   }
+
+   bool batched() const override
+   {
+      return false;
+   }
+
+   const char* name() const override
+   {
+      return "blocking";
+   }
+
+private:
+   const output_tree_t& tree_;
+};
+
+#if BTTF_IO_URING
+
+// every file is a hard-linked chain openat -> [fallocate] -> write -> close on a direct
+// descriptor, so one io_uring_enter submits many files and no fd goes back to the process.
+// Requests belong to the thread submitting them, so only the own ring thread touches the ring.
+struct uring_writer_t : file_writer_t
+{
+   static const unsigned Slots          = 64;  // files in flight
+   static const unsigned OpsPerFile     = 4;
+   static const size_t   FallocateSize  = 1024 * 1024;
+   static const size_t   MaxWriteSize   = 1u << 30;
+
+   static std::unique_ptr<file_writer_t> create(const output_tree_t& tree)
+   {
+      std::unique_ptr<uring_writer_t> writer(new uring_writer_t(tree));
+
+      if (!writer->init())
+         return nullptr;
+
+      writer->thread_ = std::thread([writer = writer.get()] { writer->run(); });
+
+      return writer;
+   }
+
+   explicit uring_writer_t(const output_tree_t& tree)
+      : tree_(tree)
+   {
+   }
+
+   ~uring_writer_t() override
+   {
+      if (thread_.joinable())
+      {
+         {
+            std::unique_lock<std::mutex> _(mut_);
+            stop_ = true;
+         }
+         work_cv_.notify_one();
+         thread_.join();
+      }
+
+      if (ring_fd_ >= 0)
+      {
+         if (sqes_)
+            munmap(sqes_, sqes_size_);
+         if (cq_ptr_ && cq_ptr_ != sq_ptr_)
+            munmap(cq_ptr_, cq_size_);
+         if (sq_ptr_)
+            munmap(sq_ptr_, sq_size_);
+         close(ring_fd_);
+      }
+   }
+
+   void write(const output_entry_t& entry, const char* data, size_t size, std::shared_ptr<const void> keep) override
+   {
+      if (size > MaxWriteSize)
+      {
+         write_blocking(tree_, entry, data, size);
+         return;
+      }
+
+      request_t req;
+      req.entry = entry;
+      req.dir_fd = tree_.dir_fd(entry.dir);
+      req.path = req.dir_fd >= 0 ? entry.leaf : tree_.path(entry).string();
+      req.data = data;
+      req.size = size;
+      req.keep = std::move(keep);
+
+      std::unique_lock<std::mutex> lock(mut_);
+
+      space_cv_.wait(lock, [this] { return queue_.size() < Slots; });
+
+      queue_.push_back(std::move(req));
+
+      lock.unlock();
+      work_cv_.notify_one();
+   }
+
+   void flush() override
+   {
+      std::unique_lock<std::mutex> lock(mut_);
+
+      idle_cv_.wait(lock, [this] { return queue_.empty() && in_flight_ == 0; });
+   }
+
+   bool batched() const override
+   {
+      return true;
+   }
+
+   const char* name() const override
+   {
+      return "io_uring";
+   }
+
+private:
+   struct request_t
+   {
+      output_entry_t entry;
+      int         dir_fd = -1;
+      std::string path;   // relative to dir_fd if it is cached
+      const char* data = nullptr;
+      size_t      size = 0;
+      std::shared_ptr<const void> keep;
+      unsigned    pending = 0; // completions to wait for
+      int         error = 0;
+   };
+
+   // files queued while the ring is busy are submitted together with the next enter
+   void run()
+   {
+      std::vector<request_t> failed;
+
+      std::unique_lock<std::mutex> lock(mut_);
+
+      for (;;)
+      {
+         work_cv_.wait(lock, [this] { return stop_ || !queue_.empty() || in_flight_ > 0; });
+
+         if (queue_.empty() && in_flight_ == 0)
+            break;
+
+         while (!queue_.empty() && !free_slots_.empty())
+         {
+            auto slot = free_slots_.back();
+            free_slots_.pop_back();
+
+            requests_[slot] = std::move(queue_.front());
+            queue_.pop_front();
+
+            prepare(slot, requests_[slot]);
+            ++in_flight_;
+         }
+
+         lock.unlock();
+         space_cv_.notify_all();
+
+         unsigned finished = 0;
+
+         try
+         {
+            finished = submit_and_reap(failed);
+         }
+         catch (const std::exception& e)
+         {
+            // the ring is broken, the files in flight are written the usual way
+            BTTF_ERROR() << e.what();
+            finished = abandon(failed);
+         }
+
+         write_failed(failed);
+         failed.clear();
+
+         lock.lock();
+         in_flight_ -= finished;
+
+         if (queue_.empty() && in_flight_ == 0)
+            idle_cv_.notify_all();
+      }
+   }
+
+   enum op_t : uint64_t
+   {
+      Open, Fallocate, Write, Close
+   };
+
+   bool init()
+   {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+
+      ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, Slots * OpsPerFile, &params));
+
+      if (ring_fd_ < 0)
+      {
+         BTTF_DEBUG() << "io_uring is not available: " << strerror(errno);
+         return false;
+      }
+
+      sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+      bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+      if (single_mmap)
+         sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+      sq_ptr_ = map(sq_size_, IORING_OFF_SQ_RING);
+      cq_ptr_ = single_mmap ? sq_ptr_ : map(cq_size_, IORING_OFF_CQ_RING);
+
+      sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+      sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+      if (!sq_ptr_ || !cq_ptr_ || !sqes_)
+      {
+         BTTF_DEBUG() << "io_uring rings can't be mapped: " << strerror(errno);
+         return false;
+      }
+
+      auto sq = static_cast<char*>(sq_ptr_);
+      sq_head_    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+      sq_tail_    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      sq_mask_    = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      sq_entries_ = params.sq_entries;
+      sq_array_   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+      auto cq = static_cast<char*>(cq_ptr_);
+      cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+      cqes_    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+      // the files are opened straight into the slots of the sparse table
+      io_uring_rsrc_register reg;
+      memset(&reg, 0, sizeof(reg));
+      reg.nr    = Slots;
+      reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+      if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0)
+      {
+         BTTF_DEBUG() << "io_uring direct descriptors are not supported: " << strerror(errno);
+         return false;
+      }
+
+      sq_tail_local_ = *sq_tail_;
+
+      requests_.resize(Slots);
+      for (unsigned slot = Slots; slot > 0; --slot)
+         free_slots_.push_back(slot - 1);
+
+      return true;
+   }
+
+   void* map(size_t size, off_t offset)
+   {
+      auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+      return ptr == MAP_FAILED ? nullptr : ptr;
+   }
+
+   // the ring has room for all ops of all slots
+   io_uring_sqe* next_sqe()
+   {
+      auto index = sq_tail_local_ & sq_mask_;
+      auto sqe = &sqes_[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sq_array_[index] = index;
+      ++sq_tail_local_;
+      ++to_submit_;
+      return sqe;
+   }
+
+   void prepare(unsigned slot, request_t& req)
+   {
+      auto sqe = next_sqe();
+      sqe->opcode     = IORING_OP_OPENAT;
+      sqe->fd         = req.dir_fd >= 0 ? req.dir_fd : AT_FDCWD;
+      sqe->addr       = reinterpret_cast<uint64_t>(req.path.c_str());
+      sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC; // direct descriptors reject O_CLOEXEC
+      sqe->len        = 0644;
+      sqe->file_index = slot + 1;
+      sqe->flags      = IOSQE_IO_HARDLINK;
+      sqe->user_data  = user_data(slot, Open);
+      ++req.pending;
+
+      if (req.size >= FallocateSize)
+      {
+         sqe = next_sqe();
+         sqe->opcode    = IORING_OP_FALLOCATE;
+         sqe->fd        = static_cast<int>(slot);
+         sqe->off       = 0;
+         sqe->addr      = req.size;
+         sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+         sqe->user_data = user_data(slot, Fallocate);
+         ++req.pending;
+      }
+
+      if (req.size > 0)
+      {
+         sqe = next_sqe();
+         sqe->opcode    = IORING_OP_WRITE;
+         sqe->fd        = static_cast<int>(slot);
+         sqe->off       = 0;
+         sqe->addr      = reinterpret_cast<uint64_t>(req.data);
+         sqe->len       = static_cast<uint32_t>(req.size);
+         sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+         sqe->user_data = user_data(slot, Write);
+         ++req.pending;
+      }
+
+      sqe = next_sqe();
+      sqe->opcode     = IORING_OP_CLOSE;
+      sqe->file_index = slot + 1;
+      sqe->user_data  = user_data(slot, Close);
+      ++req.pending;
+   }
+
+   static uint64_t user_data(unsigned slot, op_t op)
+   {
+      return (uint64_t(slot) << 8) | op;
+   }
+
+   // waits for at least one completion, returns the number of finished files
+   unsigned submit_and_reap(std::vector<request_t>& failed)
+   {
+      __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+
+      for (;;)
+      {
+         auto res = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+         if (res >= 0)
+         {
+            to_submit_ -= static_cast<unsigned>(res);
+            break;
+         }
+         if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            throw std::runtime_error(std::string("io_uring_enter failed, ") + strerror(errno));
+      }
+
+      unsigned finished = 0;
+
+      auto head = *cq_head_;
+      auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+      for (; head != tail; ++head)
+      {
+         const auto& cqe = cqes_[head & cq_mask_];
+
+         auto slot = static_cast<unsigned>(cqe.user_data >> 8);
+         auto op   = static_cast<op_t>(cqe.user_data & 0xff);
+         auto& req = requests_[slot];
+
+         // fallocate is only a hint, not every filesystem supports it
+         if (cqe.res < 0 && op != Fallocate && !req.error)
+            req.error = -cqe.res;
+         else if (op == Write && static_cast<size_t>(cqe.res) != req.size && !req.error)
+            req.error = EIO;
+
+         if (--req.pending == 0)
+         {
+            if (req.error)
+               failed.push_back(std::move(req));
+
+            req = request_t();
+            free_slots_.push_back(slot);
+            ++finished;
+         }
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+      return finished;
+   }
+
+   unsigned abandon(std::vector<request_t>& failed)
+   {
+      unsigned finished = 0;
+
+      for (unsigned slot = 0; slot < Slots; ++slot)
+      {
+         auto& req = requests_[slot];
+
+         if (req.pending > 0)
+         {
+            req.error = ECANCELED;
+            failed.push_back(std::move(req));
+            req = request_t();
+            ++finished;
+         }
+      }
+      return finished;
+   }
+
+   // files failed in the ring are written once more the usual way
+   void write_failed(std::vector<request_t>& failed)
+   {
+      for (auto& req : failed)
+      {
+         BTTF_DEBUG() << "io_uring write of " << tree_.path(req.entry) << " failed: " << strerror(req.error);
+         write_blocking(tree_, req.entry, req.data, req.size);
+      }
+   }
+
+private:
+   const output_tree_t& tree_;
+
+   int ring_fd_ = -1;
+
+   void*  sq_ptr_ = nullptr;
+   void*  cq_ptr_ = nullptr;
+   size_t sq_size_ = 0;
+   size_t cq_size_ = 0;
+
+   io_uring_sqe* sqes_ = nullptr;
+   size_t        sqes_size_ = 0;
+
+   unsigned* sq_head_ = nullptr;
+   unsigned* sq_tail_ = nullptr;
+   unsigned* sq_array_ = nullptr;
+   unsigned  sq_mask_ = 0;
+   unsigned  sq_entries_ = 0;
+   unsigned  sq_tail_local_ = 0;
+
+   unsigned*     cq_head_ = nullptr;
+   unsigned*     cq_tail_ = nullptr;
+   unsigned      cq_mask_ = 0;
+   io_uring_cqe* cqes_ = nullptr;
+
+   std::vector<request_t> requests_;  // by slot, used only by the ring thread
+   std::vector<unsigned>  free_slots_;
+   unsigned               to_submit_ = 0;
+
+   std::thread             thread_;
+   std::mutex              mut_;
+   std::condition_variable work_cv_;
+   std::condition_variable space_cv_;
+   std::condition_variable idle_cv_;
+   std::deque<request_t>   queue_;
+   unsigned                in_flight_ = 0;
+   bool                    stop_ = false;
+};
+
+#endif // BTTF_IO_URING
+
+} // namespace
+
+std::unique_ptr<file_writer_t> make_file_writer(const std::string& engine, const output_tree_t& tree)
+{
+   if (engine != "blocking")
+   {
+#if BTTF_IO_URING
+      if (auto writer = uring_writer_t::create(tree))
+         return writer;
+#endif
+      if (engine == "uring")
+         BTTF_WARN() << "io_uring is not available, files are written by blocking calls";
+   }
+   return std::unique_ptr<file_writer_t>(new blocking_writer_t(tree));
+}
+
+} // namespace bttf
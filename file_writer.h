@@ -0,0 +1,31 @@
+#pragma once
+
+#include "output_tree.h"
+
+#include <memory>
+#include <string>
+
+namespace bttf {
+
+// writes whole files of the unpacked archive; the data must stay valid until
+// the file is written, keep holds the owner of the data till then
+struct file_writer_t
+{
+   virtual ~file_writer_t() = default;
+
+   virtual void write(const output_entry_t& entry, const char* data, size_t size, std::shared_ptr<const void> keep = nullptr) = 0;
+
+   // waits until all queued files are written
+   virtual void flush() = 0;
+
+   // writes are queued and batched, the caller may hand over whole decompressed files
+   virtual bool batched() const = 0;
+
+   virtual const char* name() const = 0;
+};
+
+// one of "auto", "uring", "blocking"; "auto" takes io_uring where the kernel supports it.
+// The directories of the tree must be created already
+std::unique_ptr<file_writer_t> make_file_writer(const std::string& engine, const output_tree_t& tree);
+
+} // namespace bttf
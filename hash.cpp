@@ -0,0 +1,363 @@
+#include "hash.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BTTF_HASH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define BTTF_HASH_X86 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BTTF_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BTTF_TARGET_AVX2
+#endif
+
+namespace bttf {
+
+namespace {
+
+const uint64_t PRIME32_1 = 0x9E3779B1U;
+const uint64_t PRIME32_2 = 0x85EBCA77U;
+const uint64_t PRIME32_3 = 0xC2B2AE3DU;
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+const size_t Lanes = 8;
+const size_t StripesPerBlock = hasher_t::BlockSize / hasher_t::StripeSize;
+
+// layout of the secret in 64-bit words:
+//   stripe n of a block is keyed by words [n, n + 8), the last partial stripe by [16, 24)
+//   block scrambling uses [24, 32), finalization uses [32, 40) and [40, 48)
+const size_t ScrambleKey = 24;
+const size_t LowKey      = 32;
+const size_t HighKey     = 40;
+
+struct secret_t
+{
+   secret_t()
+   {
+      // splitmix64 sequence, fixed forever since digests are stored
+      uint64_t x = PRIME64_3;
+      for (auto& w : words)
+      {
+         uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+         z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+         z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+         w = z ^ (z >> 31);
+      }
+   }
+
+   alignas(32) uint64_t words[48];
+};
+
+const secret_t secret;
+
+inline uint64_t read64(const char* p)
+{
+   uint64_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+inline uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+   unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+   return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+   uint64_t hi;
+   uint64_t lo = _umul128(a, b, &hi);
+   return lo ^ hi;
+#else
+   uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+   uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+   uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+   uint64_t hi_hi = (a >> 32) * (b >> 32);
+   uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+   uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+   uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+   return lower ^ upper;
+#endif
+}
+
+inline uint64_t avalanche(uint64_t h)
+{
+   h ^= h >> 37;
+   h *= 0x165667919E3779F9ULL;
+   h ^= h >> 32;
+   return h;
+}
+
+// every stripe adds the data to the neighbour lane and the 32x32 product of keyed data to its own lane
+void accumulate_scalar(uint64_t* acc, const char* data, size_t stripes, const uint64_t* key)
+{
+   for (size_t s = 0; s < stripes; ++s, data += hasher_t::StripeSize, ++key)
+   {
+      for (size_t i = 0; i < Lanes; ++i)
+      {
+         uint64_t v = read64(data + i * 8);
+         uint64_t k = v ^ key[i];
+         acc[i ^ 1] += v;
+         acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+      }
+   }
+}
+
+void scramble_scalar(uint64_t* acc, const uint64_t* key)
+{
+   for (size_t i = 0; i < Lanes; ++i)
+   {
+      uint64_t a = acc[i];
+      a ^= a >> 47;
+      a ^= key[i];
+      acc[i] = a * PRIME32_1;
+   }
+}
+
+#if BTTF_HASH_X86
+
+void accumulate_sse2(uint64_t* acc, const char* data, size_t stripes, const uint64_t* key)
+{
+   auto xacc = reinterpret_cast<__m128i*>(acc);
+
+   for (size_t s = 0; s < stripes; ++s, data += hasher_t::StripeSize, ++key)
+   {
+      for (size_t i = 0; i < Lanes / 2; ++i)
+      {
+         __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i);
+         __m128i k  = _mm_xor_si128(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + i));
+         __m128i hi = _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1));
+         __m128i sw = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+         __m128i a  = _mm_loadu_si128(xacc + i);
+         a = _mm_add_epi64(a, _mm_add_epi64(sw, _mm_mul_epu32(k, hi)));
+         _mm_storeu_si128(xacc + i, a);
+      }
+   }
+}
+
+void scramble_sse2(uint64_t* acc, const uint64_t* key)
+{
+   auto xacc = reinterpret_cast<__m128i*>(acc);
+   const __m128i prime = _mm_set1_epi32(static_cast<int>(PRIME32_1));
+
+   for (size_t i = 0; i < Lanes / 2; ++i)
+   {
+      __m128i a = _mm_loadu_si128(xacc + i);
+      a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+      a = _mm_xor_si128(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + i));
+      __m128i lo = _mm_mul_epu32(a, prime);
+      __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+      _mm_storeu_si128(xacc + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+   }
+}
+
+BTTF_TARGET_AVX2 void accumulate_avx2(uint64_t* acc, const char* data, size_t stripes, const uint64_t* key)
+{
+   auto xacc = reinterpret_cast<__m256i*>(acc);
+
+   __m256i a0 = _mm256_loadu_si256(xacc);
+   __m256i a1 = _mm256_loadu_si256(xacc + 1);
+
+   for (size_t s = 0; s < stripes; ++s, data += hasher_t::StripeSize, ++key)
+   {
+      auto d = reinterpret_cast<const __m256i*>(data);
+      auto k = reinterpret_cast<const __m256i*>(key);
+
+      __m256i v0 = _mm256_loadu_si256(d);
+      __m256i v1 = _mm256_loadu_si256(d + 1);
+      __m256i k0 = _mm256_xor_si256(v0, _mm256_loadu_si256(k));
+      __m256i k1 = _mm256_xor_si256(v1, _mm256_loadu_si256(k + 1));
+
+      __m256i p0 = _mm256_mul_epu32(k0, _mm256_shuffle_epi32(k0, _MM_SHUFFLE(0, 3, 0, 1)));
+      __m256i p1 = _mm256_mul_epu32(k1, _mm256_shuffle_epi32(k1, _MM_SHUFFLE(0, 3, 0, 1)));
+
+      a0 = _mm256_add_epi64(a0, _mm256_add_epi64(_mm256_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2)), p0));
+      a1 = _mm256_add_epi64(a1, _mm256_add_epi64(_mm256_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)), p1));
+   }
+
+   _mm256_storeu_si256(xacc, a0);
+   _mm256_storeu_si256(xacc + 1, a1);
+}
+
+BTTF_TARGET_AVX2 void scramble_avx2(uint64_t* acc, const uint64_t* key)
+{
+   auto xacc = reinterpret_cast<__m256i*>(acc);
+   const __m256i prime = _mm256_set1_epi32(static_cast<int>(PRIME32_1));
+
+   for (size_t i = 0; i < Lanes / 4; ++i)
+   {
+      __m256i a = _mm256_loadu_si256(xacc + i);
+      a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+      a = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key) + i));
+      __m256i lo = _mm256_mul_epu32(a, prime);
+      __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+      _mm256_storeu_si256(xacc + i, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+   }
+}
+
+bool cpu_has_avx2()
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] < 7)
+      return false;
+
+   __cpuid(info, 1);
+   bool osxsave = (info[2] & (1 << 27)) != 0;
+   bool avx     = (info[2] & (1 << 28)) != 0;
+   if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+      return false;
+
+   __cpuidex(info, 7, 0);
+   return (info[1] & (1 << 5)) != 0;
+#else
+   return false;
+#endif
+}
+
+#endif // BTTF_HASH_X86
+
+struct hash_engine_t
+{
+   const char* name;
+   void (*accumulate)(uint64_t* acc, const char* data, size_t stripes, const uint64_t* key);
+   void (*scramble)(uint64_t* acc, const uint64_t* key);
+   bool (*supported)();
+};
+
+const hash_engine_t engines[] = {
+#if BTTF_HASH_X86
+   { "avx2",   accumulate_avx2,   scramble_avx2,   cpu_has_avx2 },
+   { "sse2",   accumulate_sse2,   scramble_sse2,   [] { return true; } },
+#endif
+   { "scalar", accumulate_scalar, scramble_scalar, [] { return true; } },
+};
+
+// the first supported engine is the fastest one
+const hash_engine_t* detect_engine()
+{
+   for (const auto& engine : engines)
+      if (engine.supported())
+         return &engine;
+   return &engines[0];
+}
+
+const hash_engine_t* g_engine = detect_engine();
+
+} // namespace
+
+bool select_hash_engine(const std::string& name)
+{
+   if (name == "auto")
+   {
+      g_engine = detect_engine();
+      return true;
+   }
+
+   for (const auto& engine : engines)
+   {
+      if (name == engine.name)
+      {
+         if (!engine.supported())
+            return false;
+         g_engine = &engine;
+         return true;
+      }
+   }
+   return false;
+}
+
+const char* hash_engine_name()
+{
+   return g_engine->name;
+}
+
+hasher_t::hasher_t()
+   : acc_{ { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 } }
+{
+}
+
+void hasher_t::process_block(const char* block)
+{
+   g_engine->accumulate(acc_.data(), block, StripesPerBlock, secret.words);
+   g_engine->scramble(acc_.data(), secret.words + ScrambleKey);
+}
+
+void hasher_t::update(const void* data, size_t size)
+{
+   auto src = static_cast<const char*>(data);
+
+   total_ += size;
+
+   if (buffered_ > 0)
+   {
+      auto n = std::min(size, BlockSize - buffered_);
+      memcpy(buffer_.data() + buffered_, src, n);
+      buffered_ += n;
+      src += n;
+      size -= n;
+
+      if (buffered_ < BlockSize)
+         return;
+
+      process_block(buffer_.data());
+      buffered_ = 0;
+   }
+
+   for (; size >= BlockSize; src += BlockSize, size -= BlockSize)
+      process_block(src);
+
+   if (size > 0)
+   {
+      memcpy(buffer_.data(), src, size);
+      buffered_ = size;
+   }
+}
+
+digest_t hasher_t::finish() const
+{
+   auto acc = acc_;
+
+   auto stripes = buffered_ / StripeSize;
+   g_engine->accumulate(acc.data(), buffer_.data(), stripes, secret.words);
+
+   if (auto rest = buffered_ % StripeSize)
+   {
+      std::array<char, StripeSize> last = {};
+      memcpy(last.data(), buffer_.data() + stripes * StripeSize, rest);
+      g_engine->accumulate(acc.data(), last.data(), 1, secret.words + StripesPerBlock);
+   }
+
+   uint64_t lo = total_ * PRIME64_1;
+   uint64_t hi = ~total_ * PRIME64_2;
+
+   for (size_t i = 0; i < Lanes; i += 2)
+   {
+      lo += mul128_fold64(acc[i] ^ secret.words[LowKey + i],  acc[i + 1] ^ secret.words[LowKey + i + 1]);
+      hi += mul128_fold64(acc[i] ^ secret.words[HighKey + i], acc[i + 1] ^ secret.words[HighKey + i + 1]);
+   }
+
+   return { { avalanche(lo), avalanche(hi) } };
+}
+
+digest_t hash_buffer(const void* data, size_t size)
+{
+   hasher_t hasher;
+   hasher.update(data, size);
+   return hasher.finish();
+}
+
+} // namespace bttf
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace bttf {
+
+using digest_t = std::array<uint64_t, 2>;
+
+// streaming 128-bit non-cryptographic hash, data is consumed in fixed blocks
+// by the selected engine, every engine gives the same result
+struct hasher_t
+{
+   static const size_t StripeSize = 64;
+   static const size_t BlockSize  = 16 * StripeSize;
+
+   hasher_t();
+
+   void update(const void* data, size_t size);
+
+   digest_t finish() const;
+
+private:
+   void process_block(const char* block);
+
+private:
+   std::array<uint64_t, 8>     acc_;
+   std::array<char, BlockSize> buffer_;
+   size_t                      buffered_ = 0;
+   uint64_t                    total_ = 0;
+};
+
+digest_t hash_buffer(const void* data, size_t size);
+
+// one of "auto", "avx2", "sse2", "scalar"; returns false if the engine is not supported by cpu
+bool select_hash_engine(const std::string& name);
+
+const char* hash_engine_name();
+
+} // namespace bttf
@@ -0,0 +1,144 @@
+#include "hash_cache.h"
+#include "trace.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+
+namespace fs = boost::filesystem;
+
+namespace bttf {
+
+using namespace boost::interprocess;
+
+namespace {
+
+const std::array<char, 4> CacheMagic = { {'B', 'T', 'H', 'C'} };
+const uint32_t            CacheVersion = 1; // must be changed together with the digest algorithm
+
+uint64_t path_hash(const std::string& name)
+{
+   return hash_buffer(name.data(), name.size())[0];
+}
+
+} // namespace
+
+hash_cache_t::hash_cache_t(fs::path file)
+   : file_(std::move(file))
+{
+   try
+   {
+      if (!fs::exists(file_) || fs::file_size(file_) < sizeof(hash_cache_header_t))
+         return;
+
+      mapping_ = file_mapping(file_.string().c_str(), read_only);
+      region_ = mapped_region(mapping_, read_only);
+
+      auto data = static_cast<const char*>(region_.get_address());
+      auto size = region_.get_size();
+
+      hash_cache_header_t header;
+      memcpy(&header, data, sizeof(header));
+
+      if (header.magic != CacheMagic || header.version != CacheVersion
+         || sizeof(header) + header.entries * sizeof(hash_cache_entry_t) + header.names_size != size)
+      {
+         BTTF_WARN() << "hash cache " << file_ << " is incorrect, it will be rebuilt";
+         region_ = mapped_region();
+         return;
+      }
+
+      entries_ = reinterpret_cast<const hash_cache_entry_t*>(data + sizeof(header));
+      names_   = data + sizeof(header) + header.entries * sizeof(hash_cache_entry_t);
+      count_   = header.entries;
+
+      BTTF_DEBUG() << "hash cache " << file_ << " has " << count_ << " entries";
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_WARN() << "hash cache " << file_ << " can't be opened : " << e.what();
+      entries_ = nullptr;
+      count_ = 0;
+   }
+}
+
+boost::optional<digest_t> hash_cache_t::find(const std::string& name, const file_stat_t& st) const
+{
+   auto hash = path_hash(name);
+
+   auto end = entries_ + count_;
+   auto entry = std::lower_bound(entries_, end, hash, [](const hash_cache_entry_t& e, uint64_t h)
+      {
+         return e.path_hash < h;
+      });
+
+   for (; entry != end && entry->path_hash == hash; ++entry)
+   {
+      if (entry->name_len == name.size() && std::equal(name.begin(), name.end(), names_ + entry->name_offset))
+      {
+         if (entry->size == st.size && entry->mtime == st.mtime && entry->inode == st.inode && entry->dev == st.dev)
+            return entry->digest;
+         break;
+      }
+   }
+   return boost::none;
+}
+
+void hash_cache_t::update(const std::string& name, const file_stat_t& st, const digest_t& digest)
+{
+   hash_cache_entry_t entry = {};
+   entry.path_hash = path_hash(name);
+   entry.name_len  = static_cast<uint32_t>(name.size());
+   entry.size      = st.size;
+   entry.mtime     = st.mtime;
+   entry.inode     = st.inode;
+   entry.dev       = st.dev;
+   entry.digest    = digest;
+
+   std::unique_lock<std::mutex> _(mut_);
+
+   entry.name_offset = new_names_.size();
+   new_names_.insert(new_names_.end(), name.begin(), name.end());
+   new_entries_.push_back(entry);
+}
+
+void hash_cache_t::save()
+{
+   std::unique_lock<std::mutex> _(mut_);
+
+   std::sort(new_entries_.begin(), new_entries_.end(), [](const hash_cache_entry_t& a, const hash_cache_entry_t& b)
+      {
+         return a.path_hash < b.path_hash;
+      });
+
+   hash_cache_header_t header;
+   header.magic      = CacheMagic;
+   header.version    = CacheVersion;
+   header.entries    = new_entries_.size();
+   header.names_size = new_names_.size();
+
+   auto temp = file_;
+   temp += ".tmp";
+
+   {
+      fs::ofstream ofs;
+      ofs.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+      ofs.open(temp, std::ios::binary);
+
+      ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      ofs.write(reinterpret_cast<const char*>(new_entries_.data()), new_entries_.size() * sizeof(hash_cache_entry_t));
+      ofs.write(new_names_.data(), new_names_.size());
+   }
+
+   // the old cache must be unmapped before it is replaced
+   entries_ = nullptr;
+   names_ = nullptr;
+   count_ = 0;
+   region_ = mapped_region();
+   mapping_ = file_mapping();
+
+   fs::rename(temp, file_);
+}
+
+} // namespace bttf
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "utilities.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/optional.hpp>
+
+#include <mutex>
+#include <vector>
+
+namespace bttf {
+
+#pragma pack (push, 1)
+
+struct hash_cache_header_t
+{
+   std::array<char, 4> magic;
+   uint32_t            version;
+   uint64_t            entries;
+   uint64_t            names_size;
+};
+
+// entries are sorted by path_hash, names follow the entries
+struct hash_cache_entry_t
+{
+   uint64_t path_hash;
+   uint64_t name_offset;
+   uint32_t name_len;
+   uint32_t reserved;
+   uint64_t size;
+   int64_t  mtime;
+   uint64_t inode;
+   uint64_t dev;
+   digest_t digest;
+};
+
+#pragma pack (pop)
+
+// digests of files from previous runs keyed on (relative path, size, mtime, inode, dev)
+struct hash_cache_t
+{
+   explicit hash_cache_t(boost::filesystem::path file);
+
+   boost::optional<digest_t> find(const std::string& name, const file_stat_t& st) const;
+
+   // remembers the digest to be stored by save()
+   void update(const std::string& name, const file_stat_t& st, const digest_t& digest);
+
+   // replaces the cache file with entries updated during this run
+   void save();
+
+private:
+   const boost::filesystem::path file_;
+
+   boost::interprocess::file_mapping  mapping_;
+   boost::interprocess::mapped_region region_;
+
+   const hash_cache_entry_t* entries_ = nullptr;
+   const char*               names_ = nullptr;
+   size_t                    count_ = 0;
+
+   std::mutex mut_;
+   std::vector<hash_cache_entry_t> new_entries_;
+   std::vector<char>               new_names_;
+};
+
+} // namespace bttf
@@ -0,0 +1,333 @@
+#include "index.h"
+#include "compress.h"
+#include "trace.h"
+
+#include <boost/filesystem.hpp>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <map>
+
+namespace fs = boost::filesystem;
+
+namespace bttf {
+
+static bool valid_footer(const footer_t& footer, uint64_t archive_size)
+{
+   return footer.magic == FooterMagic
+      && footer.index_offset >= ArchiveHeaderSize
+      && footer.index_offset + footer.index_size + sizeof(footer_t) == archive_size;
+}
+
+uint32_t check_header(const char* data, size_t size)
+{
+   if (size < ArchiveHeaderSize || !std::equal(data, data + FileHeader.size(), FileHeader.data()))
+      throw std::runtime_error("Input file is not a correct archive");
+
+   uint32_t version;
+   memcpy(&version, data + FileHeader.size(), sizeof(version));
+
+   if (version == FormatVersion)
+      return version;
+
+   // a legacy archive starts with a file node of a non-empty name, it never looks like a small number
+   legacy_node_hdr_t hdr;
+   memcpy(&hdr, data + FileHeader.size(), sizeof(hdr));
+
+   if (hdr.status == node_hdr_t::estatus::File && hdr.name_len != 0)
+      return LegacyFormatVersion;
+
+   throw std::runtime_error("Unsupported version of the archive format: " + std::to_string(version));
+}
+
+// the end of the nodes after offset up to the next end node, which is returned too; 0 if a node is out of the archive
+static uint64_t skip_nodes(const char* data, uint64_t size, uint64_t offset, const file_node_t*& end_node)
+{
+   end_node = nullptr;
+
+   while (offset + sizeof(link_node_t) <= size)
+   {
+      auto hdr = reinterpret_cast<const node_hdr_t*>(data + offset);
+
+      if (hdr->status == node_hdr_t::estatus::Link)
+      {
+         offset += sizeof(link_node_t) + hdr->name_len;
+         continue;
+      }
+
+      if (offset + sizeof(file_node_t) > size)
+         return 0;
+
+      auto node = static_cast<const file_node_t*>(hdr);
+      uint64_t data_offset = offset + sizeof(file_node_t) + node->name_len;
+
+      if (node->data_len > size || data_offset + node->data_len > size)
+         return 0;
+
+      offset = data_offset + node->data_len;
+
+      if (node->end)
+      {
+         end_node = node;
+         return offset;
+      }
+
+      // the frames of a chunked file follow its node
+      if (node->chunked)
+      {
+         if (node->data_len < sizeof(frame_table_t))
+            return 0;
+
+         frame_table_t table;
+         memcpy(&table, data + data_offset, sizeof(table));
+
+         for (uint32_t i = 0; i < table.frames; ++i)
+         {
+            inline_frame_t prefix;
+
+            if (offset + sizeof(prefix) > size)
+               return 0;
+
+            memcpy(&prefix, data + offset, sizeof(prefix));
+
+            if (prefix.len > size || offset + sizeof(prefix) + prefix.len > size)
+               return 0;
+
+            offset += sizeof(prefix) + prefix.len;
+         }
+      }
+   }
+   return offset == size ? offset : 0;
+}
+
+boost::optional<footer_t> find_footer(const char* data, size_t size)
+{
+   if (size < ArchiveHeaderSize + sizeof(footer_t))
+      return boost::none;
+
+   footer_t footer;
+   memcpy(&footer, data + size - sizeof(footer_t), sizeof(footer_t));
+
+   if (valid_footer(footer, size))
+      return footer;
+
+   // every part of an appended archive ends with its own index, the last whole one is taken
+   boost::optional<footer_t> found;
+
+   const file_node_t* end_node = nullptr;
+
+   for (uint64_t offset = ArchiveHeaderSize; (offset = skip_nodes(data, size, offset, end_node)) != 0 && end_node; )
+   {
+      if (end_node->data_len < sizeof(footer_t))
+         break;
+
+      memcpy(&footer, data + offset - sizeof(footer_t), sizeof(footer_t));
+
+      uint64_t index_offset = offset - end_node->data_len;
+
+      if (footer.magic != FooterMagic || footer.index_offset != index_offset || footer.index_size + sizeof(footer_t) != end_node->data_len)
+         break;
+
+      found = footer;
+   }
+
+   if (found)
+      BTTF_WARN() << "the archive doesn't end with its index, the one ending at " << found->index_offset + found->index_size + sizeof(footer_t) << " of " << size << " bytes is taken";
+
+   return found;
+}
+
+std::vector<index_item_t> read_legacy_nodes(const char* data, size_t size)
+{
+   std::vector<index_item_t> items;
+   std::map<int, uint64_t> sizes; // by file id
+
+   uint64_t offset = FileHeader.size();
+
+   while (offset < size)
+   {
+      if (offset + sizeof(legacy_link_node_t) > size)
+         throw std::runtime_error("Incorrect structure of the archive");
+
+      auto hdr = reinterpret_cast<const legacy_node_hdr_t*>(data + offset);
+
+      index_item_t item;
+      item.status     = static_cast<node_hdr_t::estatus>(hdr->status);
+      item.compressed = hdr->compressed != 0;
+      item.file_id    = static_cast<int>(hdr->file_id);
+      item.offset     = offset;
+
+      if (hdr->status == node_hdr_t::estatus::Link)
+      {
+         if (offset + sizeof(legacy_link_node_t) + hdr->name_len > size)
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         auto node = static_cast<const legacy_link_node_t*>(hdr);
+         item.name.assign(node->name, node->name_len);
+
+         auto iter = sizes.find(item.file_id);
+         if (iter == sizes.end())
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         item.size = iter->second;
+         offset += sizeof(legacy_link_node_t) + node->name_len;
+      }
+      else
+      {
+         if (offset + sizeof(legacy_file_node_t) > size)
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         auto node = static_cast<const legacy_file_node_t*>(hdr);
+         auto node_data = data + offset + sizeof(legacy_file_node_t) + node->name_len;
+
+         if (offset + sizeof(legacy_file_node_t) + node->name_len + node->data_len > size)
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         item.name.assign(node->name, node->name_len);
+         item.data_len = node->data_len;
+         item.size     = node->data_len;
+
+         if (item.compressed)
+         {
+            auto content_size = frame_content_size(node_data, node->data_len);
+            item.size = content_size ? *content_size : 0;
+         }
+
+         sizes[item.file_id] = item.size;
+         offset += sizeof(legacy_file_node_t) + node->name_len + node->data_len;
+      }
+
+      items.push_back(std::move(item));
+   }
+   return items;
+}
+
+std::vector<frame_ref_t> frame_refs(const file_node_t* item, const char* archive, uint64_t archive_size)
+{
+   auto data  = reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len;
+   auto table = reinterpret_cast<const frame_table_t*>(data);
+
+   std::vector<frame_ref_t> refs(table->frames);
+
+   uint64_t offset = (data - archive) + item->data_len;
+
+   for (auto& ref : refs)
+   {
+      if (offset + sizeof(inline_frame_t) > archive_size)
+         throw std::runtime_error("incorrect frame table");
+
+      inline_frame_t prefix;
+      memcpy(&prefix, archive + offset, sizeof(prefix));
+
+      ref.offset = offset + sizeof(prefix);
+      ref.len    = prefix.len;
+      offset     = ref.offset + ref.len;
+   }
+
+   for (const auto& ref : refs)
+   {
+      if (ref.offset < ArchiveHeaderSize || ref.offset + ref.len > archive_size)
+         throw std::runtime_error("incorrect frame table");
+   }
+   return refs;
+}
+
+void append_index_entry(std::vector<char>& index, const index_item_t& item)
+{
+   auto pos = index.size();
+   index.resize(pos + sizeof(index_entry_t) + item.name.size());
+
+   auto entry = reinterpret_cast<index_entry_t*>(index.data() + pos);
+   init_hdr(entry, item.status, item.name, item.file_id, item.compressed, item.chunked);
+   entry->hidden   = item.hidden;
+   entry->solid    = item.solid;
+   entry->dictionary = item.dictionary;
+   entry->offset   = item.offset;
+   entry->data_len = item.data_len;
+   entry->size     = item.size;
+   entry->mtime    = item.mtime;
+   entry->digest   = item.digest;
+   entry->crc      = item.crc;
+   memcpy(entry->name, item.name.data(), item.name.size());
+}
+
+std::vector<index_item_t> parse_index(const char* data, size_t size, uint32_t entries)
+{
+   std::vector<index_item_t> items;
+   items.reserve(entries);
+
+   auto src = data;
+   auto end = data + size;
+
+   while (src < end)
+   {
+      if (end - src < static_cast<ptrdiff_t>(sizeof(index_entry_t)))
+         throw std::runtime_error("Incorrect structure of the archive index");
+
+      auto entry = reinterpret_cast<const index_entry_t*>(src);
+
+      if (end - src < static_cast<ptrdiff_t>(sizeof(index_entry_t) + entry->name_len))
+         throw std::runtime_error("Incorrect structure of the archive index");
+
+      index_item_t item;
+      item.status     = static_cast<node_hdr_t::estatus>(entry->status);
+      item.compressed = entry->compressed != 0;
+      item.chunked    = entry->chunked != 0;
+      item.hidden     = entry->hidden != 0;
+      item.solid      = entry->solid != 0;
+      item.dictionary = entry->dictionary != 0;
+      item.file_id    = static_cast<int>(entry->file_id);
+      item.offset     = entry->offset;
+      item.data_len   = entry->data_len;
+      item.size       = entry->size;
+      item.mtime      = entry->mtime;
+      item.digest     = entry->digest;
+      item.crc        = entry->crc;
+      item.name.assign(entry->name, entry->name_len);
+
+      items.push_back(std::move(item));
+
+      src += sizeof(index_entry_t) + entry->name_len;
+   }
+
+   if (items.size() != entries)
+      throw std::runtime_error("Incorrect structure of the archive index");
+
+   return items;
+}
+
+std::vector<index_item_t> read_index(const fs::path& archive, footer_t* footer_out)
+{
+   using namespace boost::interprocess;
+
+   if (fs::file_size(archive) < ArchiveHeaderSize)
+      throw std::runtime_error("Input file is not a correct archive");
+
+   // only the pages of the header, the footer and the index are read, or of the nodes if they are walked
+   file_mapping mapping(archive.string().c_str(), read_only);
+   mapped_region region(mapping, read_only);
+
+   auto data = static_cast<const char*>(region.get_address());
+   auto size = region.get_size();
+
+   if (check_header(data, size) == LegacyFormatVersion)
+   {
+      if (footer_out)
+         throw std::runtime_error("Archive " + archive.string() + " is of the format without a version and has no index, it has to be packed again");
+
+      return read_legacy_nodes(data, size);
+   }
+
+   auto footer = find_footer(data, size);
+
+   if (!footer)
+      throw std::runtime_error("Archive " + archive.string() + " has no index");
+
+   if (footer_out)
+      *footer_out = *footer;
+
+   return parse_index(data + footer->index_offset, footer->index_size, footer->entries);
+}
+
+} // namespace bttf
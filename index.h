@@ -0,0 +1,52 @@
+#pragma once
+
+#include "structure.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/optional.hpp>
+
+namespace bttf {
+
+struct index_item_t
+{
+   node_hdr_t::estatus status = node_hdr_t::estatus::File;
+   bool                compressed = false;
+   bool                chunked = false;
+   bool                hidden = false;
+   bool                solid = false;
+   bool                dictionary = false;
+   int                 file_id = 0;
+   uint64_t            offset = 0;
+   uint64_t            data_len = 0;
+   uint64_t            size = 0;
+   int64_t             mtime = 0;
+   digest_t            digest = {};
+   uint32_t            crc = 0;
+   std::string         name;
+};
+
+void append_index_entry(std::vector<char>& index, const index_item_t& item);
+
+std::vector<index_item_t> parse_index(const char* data, size_t size, uint32_t entries);
+
+// format version of the archive, LegacyFormatVersion for archives written before the format had
+// a version; throws if the archive does not start with a header of a supported format
+uint32_t check_header(const char* data, size_t size);
+
+// locates the footer in the whole archive image, none for archives without index.
+// If the archive doesn't end with a footer, e.g. an append has been cut short, the nodes
+// are walked to the last end node followed by a whole index and footer
+boost::optional<footer_t> find_footer(const char* data, size_t size);
+
+// nodes of an archive of LegacyFormatVersion in their order, as index items of the node offsets;
+// the size of compressed files is taken from their frames. Throws if a node is out of the archive
+std::vector<index_item_t> read_legacy_nodes(const char* data, size_t size);
+
+// frames of a chunked node, they follow the node; throws if they are out of the archive
+std::vector<frame_ref_t> frame_refs(const file_node_t* item, const char* archive, uint64_t archive_size);
+
+// reads only the footer and the central directory of the archive, the nodes of a legacy archive
+// are listed instead; a legacy archive has no footer to return, so it throws if footer is given
+std::vector<index_item_t> read_index(const boost::filesystem::path& archive, footer_t* footer = nullptr);
+
+} // namespace bttf
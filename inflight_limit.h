@@ -0,0 +1,58 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace bttf {
+
+// bytes taken by the work started and not finished yet, the taker waits while there are too many.
+// a single request bigger than the limit is let through when nothing else is taken, so it never deadlocks
+struct inflight_limit_t : boost::noncopyable
+{
+   inflight_limit_t(uint64_t limit, lock_stats_t& stats)
+      : limit_(limit)
+      , stats_(stats)
+   {
+   }
+
+   void acquire(uint64_t size)
+   {
+      std::unique_lock<std::mutex> lock(mut_);
+
+      auto fits = [this, size] { return used_ == 0 || used_ + size <= limit_; };
+
+      if (!fits())
+      {
+         auto start = std::chrono::steady_clock::now();
+         cv_.wait(lock, fits);
+         stats_.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+         ++stats_.contended;
+      }
+      ++stats_.acquisitions;
+      used_ += size;
+   }
+
+   void release(uint64_t size)
+   {
+      {
+         std::unique_lock<std::mutex> _(mut_);
+         used_ -= size;
+      }
+      cv_.notify_all();
+   }
+
+private:
+   const uint64_t          limit_;
+   lock_stats_t&           stats_;
+   uint64_t                used_ = 0;
+   std::mutex              mut_;
+   std::condition_variable cv_;
+};
+
+} // namespace bttf
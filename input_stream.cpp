@@ -0,0 +1,131 @@
+#include "input_stream.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace bttf {
+
+// reads from the pipe are done in pieces of this size, bigger reads go straight to the caller
+static const size_t StreamBufferSize = 1024 * 1024;
+
+input_stream_t::input_stream_t()
+   : buffer_(StreamBufferSize)
+{
+}
+
+bool input_stream_t::read(void* dst, size_t size)
+{
+   auto out = static_cast<char*>(dst);
+   size_t done = 0;
+
+   while (done < size)
+   {
+      if (begin_ == end_)
+      {
+         size_t got = size - done >= buffer_.size() ? read_some(out + done, size - done) : fill();
+
+         if (got == 0)
+         {
+            if (done == 0)
+               return false;
+            throw std::runtime_error("the archive stream is truncated");
+         }
+
+         if (begin_ == end_)
+         {
+            done += got;
+            position_ += got;
+         }
+         continue;
+      }
+
+      size_t part = std::min(size - done, end_ - begin_);
+      memcpy(out + done, buffer_.data() + begin_, part);
+
+      begin_    += part;
+      done      += part;
+      position_ += part;
+   }
+   return true;
+}
+
+void input_stream_t::skip(uint64_t size)
+{
+   while (size > 0)
+   {
+      if (begin_ == end_ && fill() == 0)
+         throw std::runtime_error("the archive stream is truncated");
+
+      size_t part = static_cast<size_t>(std::min<uint64_t>(size, end_ - begin_));
+
+      begin_    += part;
+      size      -= part;
+      position_ += part;
+   }
+}
+
+void input_stream_t::drain()
+{
+   begin_ = end_;
+
+   while (size_t got = fill())
+   {
+      position_ += got;
+      begin_ = end_;
+   }
+}
+
+size_t input_stream_t::fill()
+{
+   begin_ = 0;
+   end_   = read_some(buffer_.data(), buffer_.size());
+   return end_;
+}
+
+#ifdef _WIN32
+
+size_t input_stream_t::read_some(void* dst, size_t size)
+{
+   DWORD got = 0;
+   DWORD part = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+
+   if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), dst, part, &got, nullptr))
+   {
+      // the writer has closed its end of the pipe
+      if (GetLastError() == ERROR_BROKEN_PIPE)
+         return 0;
+      throw std::runtime_error("reading of the archive stream failed, error " + std::to_string(GetLastError()));
+   }
+   return got;
+}
+
+#else
+
+size_t input_stream_t::read_some(void* dst, size_t size)
+{
+   for (;;)
+   {
+      auto res = ::read(STDIN_FILENO, dst, size);
+
+      if (res >= 0)
+         return static_cast<size_t>(res);
+
+      if (errno != EINTR)
+         throw std::runtime_error(std::string("reading of the archive stream failed, ") + strerror(errno));
+   }
+}
+
+#endif
+
+} // namespace bttf
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <vector>
+#include <cstdint>
+
+namespace bttf {
+
+// archive read strictly forward from the standard input through a bounded buffer
+struct input_stream_t : boost::noncopyable
+{
+   input_stream_t();
+
+   // reads exactly size bytes; false if the stream ends right here, throws if it ends inside
+   bool read(void* dst, size_t size);
+
+   void skip(uint64_t size);
+
+   // reads till the end of the stream, so the writer is not broken by a closed pipe
+   void drain();
+
+   // bytes read from the beginning of the stream
+   uint64_t position() const
+   {
+      return position_;
+   }
+
+private:
+   size_t fill();
+   size_t read_some(void* dst, size_t size);
+
+private:
+   std::vector<char> buffer_;
+   size_t            begin_ = 0; // unread data of the buffer
+   size_t            end_ = 0;
+   uint64_t          position_ = 0;
+};
+
+} // namespace bttf
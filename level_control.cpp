@@ -0,0 +1,87 @@
+#include "level_control.h"
+#include "trace.h"
+
+#include <algorithm>
+
+namespace bttf {
+
+// the rate is measured over windows of this length
+static const std::chrono::milliseconds WindowTime(250);
+
+// the threads are the bottleneck when they compress most of the window
+static const double BusyShare = 0.75;
+
+// the input rate is reached when it is above the target by this share; the output rate can't get
+// above the speed of the disk, so it is missed when it is below the target by this share
+static const double Headroom = 1.1;
+
+level_control_t::level_control_t(int min_level, int max_level, uint64_t input_target, uint64_t output_target,
+   const std::atomic<uint64_t>& written, unsigned threads)
+   : min_level_(min_level)
+   , max_level_(max_level)
+   , input_target_(input_target)
+   , output_target_(output_target)
+   , written_(written)
+   , threads_(std::max(1u, threads))
+   , level_(max_level)
+   , window_written_(written)
+   , window_start_(clock::now().time_since_epoch().count())
+{
+}
+
+void level_control_t::update(const start_t& start)
+{
+   auto now = clock::now();
+
+   if (start.cpu_ns != 0)
+      window_busy_ += thread_cpu_ns() - start.cpu_ns;
+   else
+      window_busy_ += std::chrono::duration_cast<std::chrono::nanoseconds>(now - start.wall).count();
+
+   auto window_end = clock::time_point(clock::duration(window_start_)) + WindowTime;
+
+   if (now >= window_end)
+   {
+      // one thread adjusts the level, the others go on with the current one
+      std::unique_lock<std::mutex> lock(mut_, std::try_to_lock);
+
+      if (lock && now >= clock::time_point(clock::duration(window_start_)) + WindowTime)
+         adjust(now);
+   }
+}
+
+void level_control_t::adjust(clock::time_point now)
+{
+   auto elapsed = std::chrono::duration<double>(now - clock::time_point(clock::duration(window_start_))).count();
+
+   uint64_t written = written_;
+
+   double input_rate  = window_input_.exchange(0) / elapsed;
+   double output_rate = (written - window_written_) / elapsed;
+   double busy        = window_busy_.exchange(0) * 1e-9 / (elapsed * threads_);
+
+   window_written_ = written;
+   window_start_   = now.time_since_epoch().count();
+
+   bool missed  = (input_target_ && input_rate < input_target_) || (output_target_ && output_rate * Headroom < output_target_);
+   bool reached = (!input_target_ || input_rate >= input_target_ * Headroom) && (!output_target_ || output_rate >= output_target_);
+
+   int level = level_;
+   int next  = level;
+
+   if (missed && busy >= BusyShare)
+      next = std::max(min_level_, level - 1);
+   else if (reached || busy < BusyShare / 2)
+      next = std::min(max_level_, level + 1);
+
+   if (next != level)
+   {
+      level_ = next;
+      ++changes_;
+
+      BTTF_DEBUG() << "compression level " << level << " -> " << next << ", input " << uint64_t(input_rate / (1024 * 1024))
+                   << " MB/s, output " << uint64_t(output_rate / (1024 * 1024)) << " MB/s, cpu " << int(busy * 100) << "%";
+   }
+}
+
+} // namespace bttf
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+namespace bttf {
+
+// moves the zstd level of the next files and frames between the limits so that the packer
+// keeps the target rates of the source read and of the archive written: the level goes down
+// while a rate is missed and the cpu time goes to compression, and up while the rates are
+// reached or the threads mostly wait for reading and writing
+struct level_control_t : boost::noncopyable
+{
+   using clock = std::chrono::steady_clock;
+
+   // when a thread has started compressing
+   struct start_t
+   {
+      clock::time_point wall;
+      uint64_t          cpu_ns; // 0 where the cpu time is not available, the wall time is taken then
+   };
+
+   // targets are in bytes per second, 0 - none; written counts the bytes written to the archive,
+   // threads are the ones compressing in parallel
+   level_control_t(int min_level, int max_level, uint64_t input_target, uint64_t output_target,
+      const std::atomic<uint64_t>& written, unsigned threads);
+
+   static start_t start()
+   {
+      return { clock::now(), thread_cpu_ns() };
+   }
+
+   int level() const
+   {
+      return level_;
+   }
+
+   // size bytes of the source have been written to the archive, compressed or stored
+   void add_input(uint64_t size)
+   {
+      window_input_ += size;
+   }
+
+   // one thread has been compressing since start
+   void update(const start_t& start);
+
+   size_t changes() const
+   {
+      return changes_;
+   }
+
+private:
+   void adjust(clock::time_point now);
+
+private:
+   const int                    min_level_;
+   const int                    max_level_;
+   const uint64_t               input_target_;
+   const uint64_t               output_target_;
+   const std::atomic<uint64_t>& written_;
+   const unsigned               threads_;
+
+   std::atomic<int>      level_;
+   std::atomic<uint64_t> window_input_{ 0 }; // source bytes written in the window
+   std::atomic<uint64_t> window_busy_{ 0 };  // cpu ns the threads spent compressing in the window
+   std::atomic<size_t>   changes_{ 0 };
+   uint64_t              window_written_;    // archive bytes written before the window, guarded by mut_
+
+   std::mutex                       mut_;
+   std::atomic<clock::duration::rep> window_start_; // guarded by mut_ for writing
+};
+
+} // namespace bttf
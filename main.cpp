@@ -3,6 +3,7 @@
 
 #include "trace.h"
 #include "utilities.h"
+#include "verifier.h"
 
 namespace bttf {
 
@@ -22,13 +23,34 @@ int main(int argc, char* argv[])
 
    g_config.severity_level = args.severity_level;
    g_config.compression_level = args.compression_level;
+   g_config.min_compression_level = args.min_compression_level;
+   g_config.target_speed = uint64_t(args.target_speed) * 1024 * 1024;
+   g_config.target_output_speed = uint64_t(args.target_output_speed) * 1024 * 1024;
+   g_config.chunk_size = args.chunk_size * 1024;
+   g_config.verify_duplicates = args.verify_duplicates;
+   g_config.hash_cache = args.hash_cache;
+   g_config.append = args.append;
+   g_config.scan_threads = args.scan_threads;
+   g_config.max_inflight_bytes = args.max_inflight_bytes;
+   g_config.solid_block_size = args.solid_block_size * 1024;
+   g_config.dictionary_size = args.dictionary_size * 1024;
+   g_config.io_engine = args.io_engine;
+   g_config.link_mode = args.link_mode;
+   g_config.stats_json = args.stats_json;
 
    namespace fs = boost::filesystem;
    namespace chr = std::chrono;
 
+   if (!select_hash_engine(args.hash_engine))
+   {
+      BTTF_ERROR() << "Hash engine '" << args.hash_engine << "' is not supported";
+      return EXIT_FAILURE;
+   }
+   BTTF_DEBUG() << "hash engine: " << hash_engine_name();
+
    try
    {
-      if (!fs::exists(args.input))
+      if (args.input != "-" && !fs::exists(args.input))
       {
          BTTF_ERROR() << "You specified nonexisting folder/file " << args.input;
          return EXIT_FAILURE;
@@ -36,7 +58,31 @@ int main(int argc, char* argv[])
 
       auto start = chr::high_resolution_clock::now();
 
-      if (fs::is_directory(args.input))
+      if (args.list)
+      {
+         bttf::list_file(args.input);
+         return EXIT_SUCCESS;
+      }
+
+      if (args.verify)
+      {
+         if (g_config.severity_level > boost::log::trivial::info)
+            g_config.severity_level = boost::log::trivial::info;
+
+         if (!verify_archive(args.input))
+         {
+            BTTF_ERROR() << "Fail, the archive is corrupted";
+            return EXIT_FAILURE;
+         }
+         BTTF_INFO() << "OK, all entries of the archive are intact";
+         return EXIT_SUCCESS;
+      }
+
+      if (args.input == "-")
+      {
+         bttf::unpack_file(args.input, args.output);
+      }
+      else if (fs::is_directory(args.input))
       {
          bttf::pack_folder(args.input, args.output);
       }
@@ -59,10 +105,10 @@ int main(int argc, char* argv[])
 
          if (!test_unpack(args.input, args.output))
          {
-            BTTF_ERROR() << "Fail, unpacked directory is not matched to the source one";
+            BTTF_ERROR() << "Fail, the archive is not matched to the source directory";
             return EXIT_FAILURE;
          }
-         BTTF_INFO() << "OK, unpacked and source directories are identical";
+         BTTF_INFO() << "OK, the archive and the source directory are identical";
       }
    }
    catch (std::exception const& err)
@@ -0,0 +1,194 @@
+#include "metrics.h"
+
+#include <iomanip>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace bttf {
+
+uint64_t thread_cpu_ns()
+{
+#ifdef _WIN32
+   FILETIME creation, exit, kernel, user;
+   if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+      return 0;
+
+   auto ticks = [](const FILETIME& t) { return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+   return (ticks(kernel) + ticks(user)) * 100;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+   timespec ts;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+      return 0;
+   return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+   return 0;
+#endif
+}
+
+phase_timer_t::phase_timer_t(phase_stats_t& phase, uint64_t bytes)
+   : phase_(phase)
+   , start_(std::chrono::steady_clock::now())
+   , cpu_start_(thread_cpu_ns())
+{
+   phase_.bytes += bytes;
+   ++phase_.calls;
+}
+
+phase_timer_t::~phase_timer_t()
+{
+   stop();
+}
+
+void phase_timer_t::stop()
+{
+   if (stopped_)
+      return;
+
+   phase_.wall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+   phase_.cpu_ns  += thread_cpu_ns() - cpu_start_;
+   stopped_ = true;
+}
+
+void queue_stats_t::push(uint64_t n)
+{
+   pushed += n;
+
+   auto current = depth += n;
+   auto max = max_depth.load();
+
+   while (current > max && !max_depth.compare_exchange_weak(max, current))
+      ;
+}
+
+void queue_stats_t::pop(uint64_t n)
+{
+   depth -= n;
+}
+
+void size_histogram_t::add(uint64_t size)
+{
+   size_t bits = 0;
+   for (; size; size >>= 1)
+      ++bits;
+
+   ++counts[bits];
+}
+
+json_writer_t::json_writer_t(std::ostream& out)
+   : out_(out)
+{
+   out_ << std::fixed << std::setprecision(3);
+}
+
+json_writer_t::~json_writer_t()
+{
+   out_ << "\n";
+}
+
+void json_writer_t::key(const char* key)
+{
+   if (!first_)
+      out_ << ",";
+
+   if (level_ > 0)
+      out_ << "\n" << std::string(level_ * 2, ' ');
+
+   if (key)
+      out_ << "\"" << key << "\": ";
+
+   first_ = false;
+}
+
+void json_writer_t::begin(const char* name)
+{
+   key(name);
+   out_ << "{";
+   ++level_;
+   first_ = true;
+}
+
+void json_writer_t::end()
+{
+   --level_;
+   out_ << "\n" << std::string(level_ * 2, ' ') << "}";
+   first_ = false;
+}
+
+void json_writer_t::value(const char* name, uint64_t value)
+{
+   key(name);
+   out_ << value;
+}
+
+void json_writer_t::value(const char* name, double value)
+{
+   key(name);
+   out_ << value;
+}
+
+void json_writer_t::value(const char* name, const std::string& value)
+{
+   key(name);
+   out_ << "\"";
+
+   for (char c : value)
+   {
+      if (c == '"' || c == '\\')
+         out_ << '\\' << c;
+      else if (static_cast<unsigned char>(c) < 0x20)
+         out_ << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+      else
+         out_ << c;
+   }
+   out_ << "\"";
+}
+
+void json_writer_t::value(const char* name, const phase_stats_t& phase)
+{
+   begin(name);
+   value("wall_ms", phase.wall_ns / 1e6);
+   value("cpu_ms", phase.cpu_ns / 1e6);
+   value("bytes", uint64_t(phase.bytes));
+   value("calls", uint64_t(phase.calls));
+   end();
+}
+
+void json_writer_t::value(const char* name, const lock_stats_t& lock)
+{
+   begin(name);
+   value("acquisitions", uint64_t(lock.acquisitions));
+   value("contended", uint64_t(lock.contended));
+   value("wait_ms", lock.wait_ns / 1e6);
+   end();
+}
+
+void json_writer_t::value(const char* name, const queue_stats_t& queue)
+{
+   begin(name);
+   value("pushed", uint64_t(queue.pushed));
+   value("max_depth", uint64_t(queue.max_depth));
+   end();
+}
+
+void json_writer_t::value(const char* name, const size_histogram_t& histogram)
+{
+   // only not empty buckets, keyed by the upper bound of the sizes they count
+   begin(name);
+   for (size_t bits = 0; bits < histogram.counts.size(); ++bits)
+   {
+      if (histogram.counts[bits] == 0)
+         continue;
+
+      auto bound = bits < 64 ? std::to_string(uint64_t(1) << bits) : std::string("inf");
+      value(("<" + bound).c_str(), uint64_t(histogram.counts[bits]));
+   }
+   end();
+}
+
+} // namespace bttf
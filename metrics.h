@@ -0,0 +1,115 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <cstdint>
+
+namespace bttf {
+
+// work of one phase summed over all threads doing it
+struct phase_stats_t
+{
+   std::atomic<uint64_t> wall_ns{ 0 };
+   std::atomic<uint64_t> cpu_ns{ 0 };  // cpu time of the threads while they were in the phase
+   std::atomic<uint64_t> bytes{ 0 };
+   std::atomic<uint64_t> calls{ 0 };
+};
+
+// cpu time of the calling thread, 0 where it is not available
+uint64_t thread_cpu_ns();
+
+// adds the wall and cpu time of its scope to the phase
+struct phase_timer_t : boost::noncopyable
+{
+   explicit phase_timer_t(phase_stats_t& phase, uint64_t bytes = 0);
+   ~phase_timer_t();
+
+   // ends the phase before the end of the scope
+   void stop();
+
+private:
+   phase_stats_t&                        phase_;
+   std::chrono::steady_clock::time_point start_;
+   uint64_t                              cpu_start_;
+   bool                                  stopped_ = false;
+};
+
+struct lock_stats_t
+{
+   std::atomic<uint64_t> acquisitions{ 0 };
+   std::atomic<uint64_t> contended{ 0 };
+   std::atomic<uint64_t> wait_ns{ 0 };
+};
+
+// an uncontended lock costs only a try_lock, the wait is measured only when the mutex is taken
+template <class Mutex>
+std::unique_lock<Mutex> timed_lock(Mutex& mut, lock_stats_t& stats)
+{
+   std::unique_lock<Mutex> lock(mut, std::try_to_lock);
+
+   if (!lock.owns_lock())
+   {
+      auto start = std::chrono::steady_clock::now();
+      lock.lock();
+      stats.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      ++stats.contended;
+   }
+   ++stats.acquisitions;
+   return lock;
+}
+
+// tasks posted to a pool and not started yet, or any other backlog
+struct queue_stats_t
+{
+   void push(uint64_t n = 1);
+   void pop(uint64_t n = 1);
+
+   std::atomic<uint64_t> pushed{ 0 };
+   std::atomic<uint64_t> depth{ 0 };
+   std::atomic<uint64_t> max_depth{ 0 };
+};
+
+// bucket n counts sizes of n significant bits: 0, 1, [2, 4), [4, 8) ...
+struct size_histogram_t
+{
+   static const size_t Buckets = 65;
+
+   void add(uint64_t size);
+
+   std::array<std::atomic<uint64_t>, Buckets> counts = {};
+};
+
+// writer of the --stats-json report, keys are written in the order they are given
+struct json_writer_t : boost::noncopyable
+{
+   explicit json_writer_t(std::ostream& out);
+   ~json_writer_t();
+
+   void begin(const char* key = nullptr);
+   void end();
+
+   void value(const char* key, uint64_t value);
+   void value(const char* key, double value);
+   void value(const char* key, const std::string& value);
+
+   void value(const char* key, const phase_stats_t& phase);
+   void value(const char* key, const lock_stats_t& lock);
+   void value(const char* key, const queue_stats_t& queue);
+   void value(const char* key, const size_histogram_t& histogram);
+
+private:
+   void key(const char* key);
+
+private:
+   std::ostream& out_;
+   int           level_ = 0;
+   bool          first_ = true;
+};
+
+} // namespace bttf
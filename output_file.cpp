@@ -0,0 +1,317 @@
+#include "output_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace bttf {
+
+output_file_t::~output_file_t()
+{
+   try
+   {
+      close();
+   }
+   catch (...)
+   {
+   }
+}
+
+void output_file_t::write_at(uint64_t offset, const void* data, size_t size)
+{
+   phase_timer_t timer(stats_.write, size);
+
+   if (!stream_)
+   {
+      if (broken_)
+         throw std::runtime_error("writing of the archive failed before");
+
+      try
+      {
+         write_file(offset, data, size);
+      }
+      catch (...)
+      {
+         fail();
+         throw;
+      }
+      return;
+   }
+
+   if (size == 0)
+      return;
+
+   auto lock = timed_lock(stream_mut_, stats_.stream_lock);
+
+   auto fits = [this, offset, size] { return broken_ || offset == written_ || pending_size_ == 0 || pending_size_ + size <= pending_limit_; };
+
+   if (pending_limit_ > 0 && !fits())
+   {
+      auto start = std::chrono::steady_clock::now();
+      pending_cv_.wait(lock, fits);
+      stats_.pending_wait.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      ++stats_.pending_wait.contended;
+      ++stats_.pending_wait.acquisitions;
+   }
+
+   // the gap will never be filled
+   if (broken_)
+      throw std::runtime_error("writing of the archive stream failed before");
+
+   if (offset != written_)
+   {
+      auto src = static_cast<const char*>(data);
+      pending_.emplace(offset, std::vector<char>(src, src + size));
+      pending_size_ += size;
+      stats_.pending.push(size);
+      return;
+   }
+
+   try
+   {
+      write_stream(data, size);
+      written_ += size;
+
+      for (auto iter = pending_.begin(); iter != pending_.end() && iter->first == written_; iter = pending_.erase(iter))
+      {
+         write_stream(iter->second.data(), iter->second.size());
+         written_ += iter->second.size();
+         pending_size_ -= iter->second.size();
+         stats_.pending.pop(iter->second.size());
+      }
+   }
+   catch (...)
+   {
+      broken_ = true;
+      pending_cv_.notify_all();
+      throw;
+   }
+
+   // waiting writers either have room now or their turn has come
+   if (pending_limit_ > 0)
+      pending_cv_.notify_all();
+}
+
+void output_file_t::fail()
+{
+   {
+      std::lock_guard<std::mutex> _(stream_mut_);
+      broken_ = true;
+   }
+   pending_cv_.notify_all();
+}
+
+void output_file_t::close()
+{
+   if (stream_)
+   {
+      // the standard output is left open
+      stream_ = false;
+#ifdef _WIN32
+      handle_ = nullptr;
+#else
+      fd_ = -1;
+#endif
+
+      if (written_ != end_ || !pending_.empty())
+         throw std::runtime_error("the archive stream has unwritten ranges");
+      return;
+   }
+   close_file();
+}
+
+#ifdef _WIN32
+
+void output_file_t::open_stream()
+{
+   handle_ = GetStdHandle(STD_OUTPUT_HANDLE);
+
+   if (handle_ == INVALID_HANDLE_VALUE || handle_ == nullptr)
+   {
+      handle_ = nullptr;
+      throw std::runtime_error("Can't write the archive to the standard output");
+   }
+   stream_ = true;
+}
+
+void output_file_t::write_stream(const void* data, size_t size)
+{
+   auto src = static_cast<const char*>(data);
+
+   while (size > 0)
+   {
+      DWORD written = 0;
+      DWORD part = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+
+      if (!WriteFile(handle_, src, part, &written, nullptr))
+         throw std::runtime_error("writing of the archive stream failed, error " + std::to_string(GetLastError()));
+
+      src  += written;
+      size -= written;
+   }
+}
+
+void output_file_t::open(const boost::filesystem::path& path, bool keep_content, uint64_t offset)
+{
+   handle_ = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+      keep_content ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+   if (handle_ == INVALID_HANDLE_VALUE)
+   {
+      handle_ = nullptr;
+      throw std::runtime_error("Can't open output file " + path.string());
+   }
+   start_ = offset;
+   end_   = offset;
+}
+
+bool output_file_t::is_open() const
+{
+   return handle_ != nullptr;
+}
+
+void output_file_t::write_file(uint64_t offset, const void* data, size_t size)
+{
+   auto src = static_cast<const char*>(data);
+
+   while (size > 0)
+   {
+      OVERLAPPED ov = {};
+      ov.Offset     = static_cast<DWORD>(offset);
+      ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+      DWORD written = 0;
+      DWORD part = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+
+      if (!WriteFile(handle_, src, part, &written, &ov))
+         throw std::runtime_error("writing to the archive failed, error " + std::to_string(GetLastError()));
+
+      src    += written;
+      offset += written;
+      size   -= written;
+   }
+}
+
+void output_file_t::sync()
+{
+   if (!stream_ && handle_ && !FlushFileBuffers(handle_))
+      throw std::runtime_error("flushing of the archive failed, error " + std::to_string(GetLastError()));
+}
+
+void output_file_t::close_file()
+{
+   if (handle_)
+   {
+      LARGE_INTEGER end;
+      end.QuadPart = static_cast<LONGLONG>(broken_ ? start_ : end_.load());
+
+      bool ok = SetFilePointerEx(handle_, end, nullptr, FILE_BEGIN) && SetEndOfFile(handle_);
+
+      CloseHandle(handle_);
+      handle_ = nullptr;
+
+      if (!ok)
+         throw std::runtime_error("truncating of the archive failed");
+   }
+}
+
+#else
+
+void output_file_t::open_stream()
+{
+   fd_ = STDOUT_FILENO;
+   stream_ = true;
+}
+
+void output_file_t::write_stream(const void* data, size_t size)
+{
+   auto src = static_cast<const char*>(data);
+
+   while (size > 0)
+   {
+      auto res = ::write(fd_, src, size);
+
+      if (res < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         throw std::runtime_error(std::string("writing of the archive stream failed, ") + strerror(errno));
+      }
+
+      src  += res;
+      size -= res;
+   }
+}
+
+void output_file_t::open(const boost::filesystem::path& path, bool keep_content, uint64_t offset)
+{
+   fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | (keep_content ? 0 : O_TRUNC), 0644);
+
+   if (fd_ < 0)
+      throw std::runtime_error("Can't open output file " + path.string() + ", " + strerror(errno));
+
+   start_ = offset;
+   end_   = offset;
+}
+
+bool output_file_t::is_open() const
+{
+   return fd_ >= 0;
+}
+
+void output_file_t::write_file(uint64_t offset, const void* data, size_t size)
+{
+   auto src = static_cast<const char*>(data);
+
+   while (size > 0)
+   {
+      auto res = ::pwrite(fd_, src, size, static_cast<off_t>(offset));
+
+      if (res < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         throw std::runtime_error(std::string("writing to the archive failed, ") + strerror(errno));
+      }
+
+      src    += res;
+      offset += res;
+      size   -= res;
+   }
+}
+
+void output_file_t::sync()
+{
+   if (!stream_ && fd_ >= 0 && ::fsync(fd_) != 0)
+      throw std::runtime_error(std::string("flushing of the archive failed, ") + strerror(errno));
+}
+
+void output_file_t::close_file()
+{
+   if (fd_ >= 0)
+   {
+      int error = ::ftruncate(fd_, static_cast<off_t>(broken_ ? start_ : end_.load())) == 0 ? 0 : errno;
+
+      ::close(fd_);
+      fd_ = -1;
+
+      if (error)
+         throw std::runtime_error(std::string("truncating of the archive failed, ") + strerror(error));
+   }
+}
+
+#endif
+
+} // namespace bttf
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace bttf {
+
+struct output_file_stats_t
+{
+   phase_stats_t write;       // positional writes, or writes of the stream with the wait for their turn
+   lock_stats_t  stream_lock;
+   queue_stats_t pending;     // bytes of the stream waiting for a gap to be filled
+   lock_stats_t  pending_wait; // writers waiting for the pending bytes to go below the limit
+};
+
+// archive written by many threads at once, every writer reserves its own range
+// of the file with an atomic add and fills it with positional writes without any lock.
+// A stream (stdout) is written strictly forward: ranges written before the earlier
+// ones wait in memory until the gap is filled.
+// A reserved range which is never written leaves a hole in the file or a gap the stream
+// never gets over, so a failed write fails the whole output
+struct output_file_t : boost::noncopyable
+{
+   output_file_t() = default;
+   ~output_file_t();
+
+   // a new file is created if !keep_content, otherwise writing goes on from the offset
+   void open(const boost::filesystem::path& path, bool keep_content, uint64_t offset = 0);
+
+   // the archive goes to the standard output
+   void open_stream();
+
+   // a writer of the stream waits while the ranges after a gap take more than the limit, 0 - unlimited.
+   // the writer of the gap always goes on, so the waits end
+   void set_pending_limit(uint64_t limit)
+   {
+      pending_limit_ = limit;
+   }
+
+   bool is_open() const;
+
+   bool is_stream() const
+   {
+      return stream_;
+   }
+
+   uint64_t reserve(uint64_t size)
+   {
+      return end_.fetch_add(size);
+   }
+
+   // throws if this or an earlier write has failed
+   void write_at(uint64_t offset, const void* data, size_t size);
+
+   // a reserved range will never be written: the writers waiting for the gap of the stream
+   // are released, further writes throw and close() cuts the file back to the opening offset
+   void fail();
+
+   bool failed() const
+   {
+      return broken_;
+   }
+
+   // end of the reserved ranges
+   uint64_t size() const
+   {
+      return end_;
+   }
+
+   // the written ranges reach the disk before anything written later, nothing is done for a stream
+   void sync();
+
+   // cuts the file at the end of the reserved ranges, or at the opening offset if the output has failed
+   void close();
+
+   const output_file_stats_t& stats() const
+   {
+      return stats_;
+   }
+
+private:
+   void write_file(uint64_t offset, const void* data, size_t size);
+   void write_stream(const void* data, size_t size);
+   void close_file();
+
+private:
+#ifdef _WIN32
+   void* handle_ = nullptr;
+#else
+   int fd_ = -1;
+#endif
+   std::atomic<uint64_t> end_ = 0;
+   uint64_t              start_ = 0;
+
+   bool                 stream_ = false;
+   std::mutex           stream_mut_;
+   uint64_t             written_ = 0;                     // guarded by stream_mut_
+   std::map<uint64_t, std::vector<char>> pending_;        // ranges after a gap, guarded by stream_mut_
+   uint64_t             pending_size_ = 0;                // guarded by stream_mut_
+   uint64_t             pending_limit_ = 0;
+   std::atomic<bool>    broken_{ false };                 // a write has failed, set under stream_mut_
+   std::condition_variable pending_cv_;
+
+   output_file_stats_t stats_;
+};
+
+} // namespace bttf
@@ -0,0 +1,387 @@
+#include "output_tree.h"
+#include "trace.h"
+
+#include <boost/filesystem.hpp>
+
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <atomic>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace bttf {
+
+// levels smaller than this are created by the calling thread
+static const size_t ParallelLevelSize = 64;
+
+// descriptors left to the files being written and to the archive
+static const size_t FreeDescriptors = 256;
+static const size_t MaxDescriptors  = 1 << 16;
+
+// ranges shared by reflink must be aligned to the filesystem block
+static const uint64_t CloneAlignment = 4096;
+
+static bool is_separator(char c)
+{
+#ifdef _WIN32
+   return c == '/' || c == '\\';
+#else
+   return c == '/';
+#endif
+}
+
+output_tree_t::output_tree_t(fs::path root)
+   : root_(std::move(root))
+{
+   dirs_.emplace_back();
+   dir_index_[std::string()] = 0;
+}
+
+output_tree_t::~output_tree_t()
+{
+#ifndef _WIN32
+   for (auto& dir : dirs_)
+   {
+      if (dir.fd >= 0)
+         ::close(dir.fd);
+   }
+#endif
+}
+
+output_entry_t output_tree_t::add(const std::string& name)
+{
+   std::unique_lock<std::shared_mutex> _(mut_);
+
+   auto pos = std::find_if(name.rbegin(), name.rend(), is_separator);
+
+   output_entry_t entry;
+
+   if (pos == name.rend())
+   {
+      entry.leaf = name;
+      return entry;
+   }
+
+   auto split = name.size() - (pos - name.rbegin()) - 1;
+
+   entry.dir  = add_dir(name.substr(0, split));
+   entry.leaf = name.substr(split + 1);
+   return entry;
+}
+
+uint32_t output_tree_t::add_dir(const std::string& rel)
+{
+   auto iter = dir_index_.find(rel);
+   if (iter != dir_index_.end())
+      return iter->second;
+
+   auto pos = std::find_if(rel.rbegin(), rel.rend(), is_separator);
+
+   dir_t dir;
+
+   if (pos == rel.rend())
+      dir.leaf = rel;
+   else
+   {
+      auto split = rel.size() - (pos - rel.rbegin()) - 1;
+      dir.parent = add_dir(rel.substr(0, split));
+      dir.leaf   = rel.substr(split + 1);
+   }
+
+   dir.depth = dirs_[dir.parent].depth + 1;
+   dir.rel   = rel;
+
+   max_depth_ = std::max(max_depth_, dir.depth);
+
+   auto index = static_cast<uint32_t>(dirs_.size());
+   dirs_.push_back(std::move(dir));
+   dir_index_[rel] = index;
+
+   if (created_)
+      create_dir(dirs_[index], fds_used_++);
+
+   return index;
+}
+
+int output_tree_t::dir_fd(uint32_t dir) const
+{
+   std::shared_lock<std::shared_mutex> _(mut_);
+   return dirs_[dir].fd;
+}
+
+size_t output_tree_t::dirs() const
+{
+   std::shared_lock<std::shared_mutex> _(mut_);
+   return dirs_.size();
+}
+
+fs::path output_tree_t::path(const output_entry_t& entry) const
+{
+   std::shared_lock<std::shared_mutex> _(mut_);
+
+   const auto& dir = dirs_[entry.dir];
+   return dir.rel.empty() ? root_ / entry.leaf : root_ / dir.rel / entry.leaf;
+}
+
+void output_tree_t::create()
+{
+   fs::create_directories(root_);
+
+   open_root();
+
+   std::vector<std::vector<uint32_t>> levels(max_depth_ + 1);
+
+   for (uint32_t i = 1; i < dirs_.size(); ++i)
+      levels[dirs_[i].depth].push_back(i);
+
+   fds_used_ = dirs_[0].fd >= 0 ? 1 : 0;
+
+   // a level starts when all its parents exist
+   for (const auto& level : levels)
+   {
+      if (level.size() < ParallelLevelSize)
+      {
+         for (auto i : level)
+            create_dir(dirs_[i], fds_used_++);
+         continue;
+      }
+
+      boost::asio::thread_pool pool;
+
+      for (auto i : level)
+      {
+         boost::asio::post(pool, [this, i]
+            {
+               create_dir(dirs_[i], fds_used_++);
+            });
+      }
+      pool.join();
+   }
+   created_ = true;
+}
+
+#ifdef _WIN32
+
+void output_tree_t::open_root()
+{
+}
+
+void output_tree_t::create_dir(dir_t& dir, size_t fds_used)
+{
+   boost::system::error_code ec;
+
+   fs::create_directory(root_ / dir.rel, ec);
+
+   if (ec)
+      BTTF_ERROR() << "An error has occured while creating the directory " << root_ / dir.rel << ", :" << ec.message();
+}
+
+source_handle_t::source_handle_t(const fs::path& path)
+{
+}
+
+source_handle_t::~source_handle_t()
+{
+}
+
+output_handle_t::output_handle_t(const output_tree_t& tree, const output_entry_t& entry)
+   : path_(tree.path(entry))
+{
+   ofs_.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+   ofs_.open(path_, std::ios::binary | std::ios::trunc);
+}
+
+output_handle_t::~output_handle_t()
+{
+}
+
+void output_handle_t::write(const char* data, size_t size)
+{
+   ofs_.write(data, size);
+}
+
+void output_handle_t::resize(uint64_t size)
+{
+   ofs_.close();
+   fs::resize_file(path_, size);
+}
+
+bool output_handle_t::copy_from(const source_handle_t& source, uint64_t offset, uint64_t size)
+{
+   return false;
+}
+
+#else
+
+// descriptors are kept while the process limit allows it, other directories are used by the path
+void output_tree_t::open_root()
+{
+   struct rlimit limit;
+   if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+   {
+      if (limit.rlim_cur < limit.rlim_max)
+      {
+         limit.rlim_cur = limit.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &limit);
+         getrlimit(RLIMIT_NOFILE, &limit);
+      }
+      fd_budget_ = limit.rlim_cur > FreeDescriptors * 2 ? std::min<size_t>(limit.rlim_cur - FreeDescriptors, MaxDescriptors) : 0;
+   }
+
+   if (fd_budget_ > 0)
+      dirs_[0].fd = ::open(root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+void output_tree_t::create_dir(dir_t& dir, size_t fds_used)
+{
+   int parent = dirs_[dir.parent].fd;
+
+   auto full = root_ / dir.rel;
+
+   int res = parent >= 0 ? ::mkdirat(parent, dir.leaf.c_str(), 0755) : ::mkdir(full.c_str(), 0755);
+
+   if (res != 0 && errno != EEXIST)
+   {
+      BTTF_ERROR() << "An error has occured while creating the directory " << full << ", :" << strerror(errno);
+      return;
+   }
+
+   if (fds_used < fd_budget_)
+   {
+      dir.fd = parent >= 0
+         ? ::openat(parent, dir.leaf.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+         : ::open(full.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   }
+}
+
+source_handle_t::source_handle_t(const fs::path& path)
+   : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+{
+}
+
+source_handle_t::~source_handle_t()
+{
+   if (fd_ >= 0)
+      ::close(fd_);
+}
+
+output_handle_t::output_handle_t(const output_tree_t& tree, const output_entry_t& entry)
+{
+   int dir = tree.dir_fd(entry.dir);
+
+   fd_ = dir >= 0
+      ? ::openat(dir, entry.leaf.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+      : ::open(tree.path(entry).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+   if (fd_ < 0)
+      throw std::runtime_error(std::string("can't create the file, ") + strerror(errno));
+}
+
+output_handle_t::~output_handle_t()
+{
+   if (fd_ >= 0)
+      ::close(fd_);
+}
+
+void output_handle_t::write(const char* data, size_t size)
+{
+   while (size > 0)
+   {
+      auto res = ::write(fd_, data, size);
+
+      if (res < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         throw std::runtime_error(std::string("writing failed, ") + strerror(errno));
+      }
+
+      data += res;
+      size -= res;
+   }
+}
+
+void output_handle_t::resize(uint64_t size)
+{
+   if (::ftruncate(fd_, static_cast<off_t>(size)) != 0)
+      throw std::runtime_error(std::string("resizing failed, ") + strerror(errno));
+}
+
+bool output_handle_t::copy_from(const source_handle_t& source, uint64_t offset, uint64_t size)
+{
+#ifdef __linux__
+   if (source.fd() < 0)
+      return false;
+
+   // reflink shares whole filesystem blocks only
+   if (offset % CloneAlignment == 0 && size % CloneAlignment == 0 && size > 0)
+   {
+      file_clone_range range;
+      range.src_fd      = source.fd();
+      range.src_offset  = offset;
+      range.src_length  = size;
+      range.dest_offset = 0;
+
+      if (::ioctl(fd_, FICLONERANGE, &range) == 0)
+         return true;
+   }
+
+   loff_t   in  = static_cast<loff_t>(offset);
+   uint64_t end = offset + size;
+
+   while (uint64_t(in) < end)
+   {
+      auto res = ::copy_file_range(source.fd(), &in, fd_, nullptr, end - in, 0);
+
+      if (res > 0)
+         continue;
+      if (res < 0 && errno == EINTR)
+         continue;
+      break;
+   }
+
+   // older kernels can't copy ranges between filesystems, sendfile still keeps the data in the kernel
+   while (uint64_t(in) < end)
+   {
+      off_t pos = static_cast<off_t>(in);
+      auto res = ::sendfile(fd_, source.fd(), &pos, end - in);
+
+      if (res > 0)
+      {
+         in = pos;
+         continue;
+      }
+      if (res < 0 && errno == EINTR)
+         continue;
+
+      if (uint64_t(in) == offset)
+         return false;
+
+      throw std::runtime_error(std::string("copying failed, ") + strerror(errno));
+   }
+   return true;
+#else
+   return false;
+#endif
+}
+
+#endif
+
+} // namespace bttf
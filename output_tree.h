@@ -0,0 +1,110 @@
+#pragma once
+
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+namespace bttf {
+
+// file to be written into the output tree: its directory and the name inside it
+struct output_entry_t
+{
+   uint32_t    dir = 0;
+   std::string leaf;
+};
+
+// directories of the unpacked files are collected first and created once, parents
+// before children; files are then opened relative to cached directory descriptors
+struct output_tree_t : boost::noncopyable
+{
+   explicit output_tree_t(boost::filesystem::path root);
+   ~output_tree_t();
+
+   // name is relative to the root; directories added after create() are created at once
+   output_entry_t add(const std::string& name);
+
+   // creates the collected directories level by level, every level in parallel
+   void create();
+
+   // descriptor of the directory, -1 if it is not cached
+   int dir_fd(uint32_t dir) const;
+
+   // full path of the entry for messages and for the calls without descriptors
+   boost::filesystem::path path(const output_entry_t& entry) const;
+
+   size_t dirs() const;
+
+private:
+   struct dir_t
+   {
+      uint32_t    parent = 0;
+      uint32_t    depth = 0;
+      std::string leaf;
+      std::string rel; // relative to the root
+      int         fd = -1;
+   };
+
+   uint32_t add_dir(const std::string& rel);
+   void open_root();
+   void create_dir(dir_t& dir, size_t fds_used);
+
+private:
+   const boost::filesystem::path root_;
+
+   mutable std::shared_mutex                 mut_;  // directories are added while files are written
+   std::vector<dir_t>                        dirs_; // the root is the first one
+   std::unordered_map<std::string, uint32_t> dir_index_;
+   uint32_t                                  max_depth_ = 0;
+   size_t                                    fd_budget_ = 0;
+   std::atomic<size_t>                       fds_used_{ 0 };
+   bool                                      created_ = false;
+};
+
+// file the data of the output files is copied from inside the kernel
+struct source_handle_t : boost::noncopyable
+{
+   explicit source_handle_t(const boost::filesystem::path& path);
+   ~source_handle_t();
+
+   // -1 if the file can't be opened or the platform has no descriptors
+   int fd() const
+   {
+      return fd_;
+   }
+
+private:
+   int fd_ = -1;
+};
+
+// file of the output tree opened for writing, the content is truncated
+struct output_handle_t : boost::noncopyable
+{
+   output_handle_t(const output_tree_t& tree, const output_entry_t& entry);
+   ~output_handle_t();
+
+   void write(const char* data, size_t size);
+
+   // appends the range of the source without passing it through the process: the range
+   // is shared by reflink if it is block aligned, otherwise copied by copy_file_range or
+   // sendfile; false if nothing is copied and the caller has to write the data itself
+   bool copy_from(const source_handle_t& source, uint64_t offset, uint64_t size);
+
+   void resize(uint64_t size);
+
+private:
+#ifdef _WIN32
+   boost::filesystem::path path_;
+   boost::filesystem::ofstream ofs_;
+#else
+   int fd_ = -1;
+#endif
+};
+
+} // namespace bttf
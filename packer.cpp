@@ -3,6 +3,10 @@
 #include "utilities.h"
 #include "trace.h"
 #include "compress.h"
+#include "hash_cache.h"
+#include "index.h"
+#include "crc32c.h"
+#include "verifier.h"
 
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
@@ -12,11 +16,21 @@
 
 #include <vector>
 #include <map>
+#include <future>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cctype>
 
 namespace bttf {
 
 namespace fs = boost::filesystem;
 
+// dictionaries help files too small to have their own history
+static const uint64_t DictionaryMaxFileSize = 128 * 1024;
+static const size_t   DictionaryMinSamples  = 16;
+static const size_t   DictionarySamplesRatio = 100; // samples size to dictionary size
+
 struct metadata_t
 {
    metadata_t(fs::path n)
@@ -25,16 +39,48 @@ struct metadata_t
    }
 
    fs::path name;
+   std::string rel_name; // name in the archive
    int      id = 0;
-   size_t   checksum = 0;
-   uint32_t size = 0;
+   digest_t digest = {};
+   uint32_t crc = 0;    // crc32c of the content, taken when the file is written
+   uint64_t size = 0;
    bool     saved = false;
+   bool     cached = false; // digest is taken from the hash cache
+
+   file_stat_t stat;
+
+   // hardlinks and duplicates of this file, stored as links to it once it is saved
+   std::vector<std::shared_ptr<metadata_t>> links;
 };
 
+static index_item_t make_index_item(const metadata_t& mt, node_hdr_t::estatus status, int id, uint64_t offset, uint64_t data_len)
+{
+   index_item_t item;
+   item.status   = status;
+   item.file_id  = id;
+   item.offset   = offset;
+   item.data_len = data_len;
+   item.size     = mt.size;
+   item.mtime    = mt.stat.mtime;
+   item.digest   = mt.digest;
+   item.crc      = mt.crc;
+   item.name     = mt.rel_name;
+   return item;
+}
+
 packer_t::packer_t(const boost::filesystem::path& input_folder, const boost::filesystem::path& archive_name)
    : input_folder_(input_folder)
-   , ostream_(archive_name, std::ios::binary)
 {
+   if (archive_name == "-")
+      output_.open_stream();
+   else if (g_config.append && fs::exists(archive_name))
+      open_archive(archive_name);
+   else
+      output_.open(archive_name, false);
+
+   if (!g_config.hash_cache.empty())
+      hash_cache_.reset(new hash_cache_t(g_config.hash_cache));
+
    stats_.files = scan_folder();
 
    if (stats_.files == 0)
@@ -42,49 +88,250 @@ packer_t::packer_t(const boost::filesystem::path& input_folder, const boost::fil
 
    pack();
 
-   ostream_.close();
+   archive_content_.reset();
 
-   stats_.output_size   = fs::file_size(archive_name);
+   // a range reserved and never written would be a hole in the archive, so nothing more goes to it
+   if (output_.failed())
+      throw std::runtime_error("writing of the archive failed, the archive is not complete");
+
+   write_index();
+
+   // whatever is left after the index by an append cut short before is cut off
+   output_.close();
+
+   stats_.output_size   = output_.size();
+
+   auto buffers = buffer_pool_stats();
+   stats_.contexts           = compression_contexts();
+   stats_.buffer_allocations = buffers.allocations;
+   stats_.buffer_reuses      = buffers.reuses;
+
+   if (hash_cache_)
+   {
+      try
+      {
+         hash_cache_->save();
+      }
+      catch (const std::exception& e)
+      {
+         BTTF_WARN() << "saving of hash cache failed " << e.what();
+      }
+      hash_cache_.reset();
+   }
 
    files_list_.clear();
    header_is_written_ = false;
 }
 
+packer_t::~packer_t() = default;
+
+void packer_t::open_archive(const fs::path& archive_name)
+{
+   footer_t footer;
+   archive_items_ = read_index(archive_name, &footer);
+
+   for (size_t i = 0; i < archive_items_.size(); ++i)
+   {
+      const auto& item = archive_items_[i];
+
+      // dictionaries stay in the index, the old files are compressed with them
+      if (item.dictionary)
+         continue;
+
+      if (!item.hidden)
+         archive_names_[item.name] = i;
+
+      if (item.status == node_hdr_t::estatus::File)
+      {
+         archive_files_[{ item.digest, item.size }] = i;
+         archive_sizes_.insert(item.size);
+      }
+      first_id_ = std::max(first_id_, item.file_id);
+   }
+
+   // the archive up to the end of its footer is never written: the new nodes, the whole index and the
+   // new footer follow it, so the old footer is the valid end until the new one is written completely
+   output_.open(archive_name, true, footer.index_offset + footer.index_size + sizeof(footer));
+
+   header_is_written_ = true;
+
+   if (g_config.verify_duplicates && !archive_files_.empty())
+      archive_content_.reset(new archive_content_t(archive_name));
+
+   BTTF_INFO() << "appending to the archive of " << archive_items_.size() << " entries";
+}
+
+namespace {
+
+struct scan_dir_t
+{
+   scan_dir_t(fs::path p, fs::path r)
+      : path(std::move(p))
+      , rel(std::move(r))
+   {
+   }
+
+   fs::path path;
+   fs::path rel;  // relative to the input folder
+
+   std::vector<std::pair<fs::path, file_stat_t>> files;
+   std::vector<std::unique_ptr<scan_dir_t>>      dirs;
+};
+
+// every directory is a separate task which fills only its own node of the tree
+void scan_dir(boost::asio::thread_pool& pool, scan_dir_t* dir, phase_stats_t& phase)
+{
+   phase_timer_t timer(phase);
+
+   try
+   {
+      for (const auto& entry : fs::directory_iterator(dir->path))
+      {
+         try
+         {
+            // symlinks to directories are not followed, as recursive_directory_iterator does by default
+            if (fs::is_directory(entry.symlink_status()))
+               dir->dirs.push_back(std::make_unique<scan_dir_t>(entry.path(), dir->rel / entry.path().filename()));
+            else if (fs::is_regular(entry.status()))
+               dir->files.push_back({ entry.path().filename(), stat_file(entry.path()) });
+         }
+         catch (const std::exception& e)
+         {
+            BTTF_WARN() << "An error has occured while scanning input folder : " << e.what();
+         }
+      }
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_WARN() << "An error has occured while scanning input folder : " << e.what();
+   }
+
+   std::sort(dir->files.begin(), dir->files.end(), [](const auto& a, const auto& b)
+      {
+         return a.first < b.first;
+      });
+
+   std::sort(dir->dirs.begin(), dir->dirs.end(), [](const auto& a, const auto& b)
+      {
+         return a->path < b->path;
+      });
+
+   for (auto& sub : dir->dirs)
+   {
+      boost::asio::post(pool, [&pool, sub = sub.get(), &phase]
+         {
+            scan_dir(pool, sub, phase);
+         });
+   }
+}
+
+} // namespace
+
 size_t packer_t::scan_folder()
 {
-   auto iterator = fs::recursive_directory_iterator(input_folder_);
+   scan_dir_t root(input_folder_, fs::path());
+
+   {
+      auto threads = g_config.scan_threads > 0 ? g_config.scan_threads : 2 * std::max(2u, std::thread::hardware_concurrency());
+
+      boost::asio::thread_pool pool(threads);
+
+      boost::asio::post(pool, [this, &pool, &root]
+         {
+            scan_dir(pool, &root, stats_.scan);
+         });
+
+      pool.join();
+   }
 
+   // ids are assigned in sorted path order, so they don't depend on the scanning order
    int file_counter = 0;
 
-   for (const auto& iter : iterator)
+   std::map<std::pair<uint64_t, uint64_t>, metadata_ptr> inodes;
+
+   std::function<void(const scan_dir_t&)> add_dir = [&](const scan_dir_t& dir)
    {
-      const auto& file_name = iter.path();
-      try
+      for (const auto& entry : dir.files)
+         add_file(dir.path / entry.first, (dir.rel / entry.first).string(), entry.second, file_counter, inodes);
+
+      for (const auto& sub : dir.dirs)
+         add_dir(*sub);
+   };
+
+   add_dir(root);
+
+   return file_counter + stats_.unchanged_files;
+}
+
+void packer_t::add_file(const fs::path& file_name, std::string rel_name, const file_stat_t& st, int& file_counter,
+   std::map<std::pair<uint64_t, uint64_t>, metadata_ptr>& inodes)
+{
+   auto file = std::make_shared<metadata_t>(file_name);
+
+   file->rel_name = std::move(rel_name);
+   file->saved    = false;
+   file->stat     = st;
+   file->size     = st.size;
+
+   auto existing = archive_names_.find(file->rel_name);
+
+   if (existing != archive_names_.end())
+   {
+      const auto& item = archive_items_[existing->second];
+
+      if (item.size == file->stat.size && item.mtime == file->stat.mtime)
       {
-         if (fs::is_regular(iter))
+         // the cache is saved with the entries of this run only, the unchanged file keeps its one
+         if (hash_cache_)
          {
-            auto file = std::make_shared<metadata_t>(file_name);
+            if (auto digest = hash_cache_->find(file->rel_name, file->stat))
+               hash_cache_->update(file->rel_name, file->stat, *digest);
+         }
 
-            file->id    = ++file_counter;
-            file->saved = false;
-            file->size  = fs::file_size(file_name);
+         ++stats_.unchanged_files;
+         return;
+      }
+      replaced_names_.insert(file->rel_name);
+   }
 
-            auto iter = files_list_.find({ 0, file->size });
+   file->id = first_id_ + ++file_counter;
 
-            if (iter == files_list_.end())
-               files_list_.insert({ {0, file->size}, {file} });
-            else
-               iter->second.push_back(file);
+   stats_.total_size += file->size;
+   stats_.file_sizes.add(file->size);
 
-            stats_.total_size += file->size;
-         }
+   // hardlinks of an already scanned file are not read at all
+   if (file->stat.nlink > 1 && file->stat.inode != 0)
+   {
+      auto inode = inodes.insert({ { file->stat.dev, file->stat.inode }, file });
+      if (!inode.second)
+      {
+         inode.first->second->links.push_back(file);
+         ++stats_.hardlinks;
+         return;
       }
-      catch (const std::exception& e)
+   }
+
+   if (file->size == 0)
+      file->digest = hash_buffer(nullptr, 0);
+
+   if (hash_cache_)
+   {
+      if (auto digest = hash_cache_->find(file->rel_name, file->stat))
       {
-         BTTF_WARN() << "An error has occured while scanning input folder : " << e.what();
+         file->digest = *digest;
+         file->cached = true;
+
+         // the cache is saved with the entries of this run only, a found one is carried forward
+         hash_cache_->update(file->rel_name, file->stat, file->digest);
       }
    }
-   return file_counter;
+
+   auto iter = files_list_.find({ digest_t{}, file->size });
+
+   if (iter == files_list_.end())
+      files_list_.insert({ {digest_t{}, file->size}, {file} });
+   else
+      iter->second.push_back(file);
 }
 
 void packer_t::pack()
@@ -93,42 +340,84 @@ void packer_t::pack()
 
    std::unique_ptr<thread_pool> pool(new thread_pool());
 
+   frames_pool_.reset(new thread_pool(std::max(1u, std::thread::hardware_concurrency())));
+
+   inflight_.reset(new inflight_limit_t(g_config.max_inflight_bytes ? g_config.max_inflight_bytes : UINT64_MAX, stats_.inflight));
+
+   // a range of the stream written after a gap is kept in memory until the gap is filled
+   output_.set_pending_limit(g_config.max_inflight_bytes);
+
+   if ((g_config.target_speed > 0 || g_config.target_output_speed > 0) && g_config.compression_level > 0)
+   {
+      level_control_.reset(new level_control_t(std::min(g_config.min_compression_level, g_config.compression_level), g_config.compression_level,
+         g_config.target_speed, g_config.target_output_speed, output_.stats().write.bytes, std::thread::hardware_concurrency()));
+   }
+
    write_header();
 
+   if (g_config.dictionary_size > 0 && g_config.compression_level > 0)
+      train_dictionaries();
+
    for (auto iter = files_list_.begin(); iter != files_list_.end();)
    {
-      std::unique_lock<std::mutex> _(files_mut_);
+      auto lock = timed_lock(files_mut_, stats_.files_lock);
 
-      if (iter->first.first == 0)
+      // files of the same size are grouped by content digest, digest is calculated once per file
+      if (iter->first.first == digest_t{})
       {
-         if (iter->second.size() == 1)
+         auto size  = iter->first.second;
+         auto files = std::move(iter->second);
+
+         iter = files_list_.erase(iter);
+
+         // posting may wait for the memory budget, while the hashing tasks need the lock to finish
+         lock.unlock();
+
+         if (files.size() == 1 && archive_sizes_.count(size) == 0)
          {
-            post(*pool, [this, file = iter->second.front()]
+            post_task(*pool, inflight_size(*files.front()), [this, file = files.front()]
                {
                   write_file(file);
                });
          }
+         else if (size == 0)
+         {
+            post_task(*pool, 0, [this, vec = std::move(files)]() mutable
+               {
+                  process_file_group(vec);
+               });
+         }
          else
          {
-            for (auto file : iter->second)
+            for (auto file : files)
             {
-               post(*pool, [this, file]
+               // a digest is read piece by piece, a cached one is not read at all
+               post_task(*pool, file->cached ? 0 : std::min<uint64_t>(file->size, ReadPieceSize), [this, file]
                   {
                      try
                      {
-                        file->checksum = calc_checksum(file->name);
+                        if (file->cached)
+                           ++stats_.cached_digests;
+                        else
+                        {
+                           phase_timer_t timer(stats_.hash, file->size);
+                           file->digest = calc_digest(file->name);
+                           ++stats_.hashed_files;
 
-                        std::unique_lock<std::mutex> _(files_mut_);
-                        files_list_[{file->checksum, file->size}].push_back(file);
+                           if (hash_cache_)
+                              hash_cache_->update(file->rel_name, file->stat, file->digest);
+                        }
+
+                        auto _ = timed_lock(files_mut_, stats_.files_lock);
+                        files_list_[{file->digest, file->size}].push_back(file);
                      }
                      catch (const std::exception& e)
                      {
-                        BTTF_WARN() << "calculating of checksum '" << file->name.string() << "' failed " << e.what();
+                        BTTF_WARN() << "calculating of digest '" << file->name.string() << "' failed " << e.what();
                      }
                   });
             }
          }
-         iter = files_list_.erase(iter);
       }
       else
          ++iter;
@@ -141,107 +430,942 @@ void packer_t::pack()
    {
       auto& vec = iterator.second;
 
-      post(*pool, [this, vec]() mutable
+      // the files of a group are written one by one, the content of the archive we append to only gets links
+      // unless it is compared and found different
+      uint64_t size = archive_files_.count(iterator.first) && !archive_content_ ? 0 : inflight_size(*vec.front());
+
+      post_task(*pool, size, [this, vec]() mutable
          {
             process_file_group(vec);
          });
    }
    pool->join();
+
+   write_solid_blocks();
+
+   frames_pool_->join();
+   frames_pool_.reset();
+
+   if (level_control_)
+      stats_.level_changes = level_control_->changes();
+}
+
+void packer_t::post_task(boost::asio::thread_pool& pool, uint64_t size, std::function<void()> task)
+{
+   // the submitter waits here while the posted tasks hold the whole budget, so the backlog of read
+   // and compressed data is bounded; every posted task is counted in the queue until a thread takes it
+   inflight_->acquire(size);
+   stats_.inflight_bytes.push(size);
+   stats_.file_queue.push();
+
+   boost::asio::post(pool, [this, size, task = std::move(task)]
+      {
+         stats_.file_queue.pop();
+
+         // the pack fails anyway once the output has failed
+         if (!output_.failed())
+            task();
+         stats_.inflight_bytes.pop(size);
+         inflight_->release(size);
+      });
+}
+
+uint32_t packer_t::frame_window() const
+{
+   const uint64_t window = 2 * std::max(1u, std::thread::hardware_concurrency());
+
+   if (g_config.max_inflight_bytes == 0 || g_config.compression_level == 0)
+      return static_cast<uint32_t>(window);
+
+   // two windows of a file are in memory at once, one file may take up to a half of the budget
+   uint64_t frame = g_config.chunk_size + compress_bound(g_config.chunk_size);
+
+   return static_cast<uint32_t>(std::max<uint64_t>(1, std::min(window, g_config.max_inflight_bytes / (4 * frame))));
+}
+
+uint64_t packer_t::inflight_size(const metadata_t& mt) const
+{
+   if (g_config.compression_level == 0)
+      return std::min<uint64_t>(mt.size, g_config.chunk_size);
+
+   // a big file is compressed by windows of frames, its read pages are dropped behind them,
+   // and the frames of the whole file are kept until it is written
+   if (mt.size > g_config.chunk_size)
+      return std::min<uint64_t>(mt.size + compress_bound(mt.size), compress_bound(mt.size) + 2 * uint64_t(frame_window()) * g_config.chunk_size);
+
+   // the mapped content and the compressed copy of it
+   return mt.size + compress_bound(mt.size);
+}
+
+int packer_t::compression_level() const
+{
+   return level_control_ ? level_control_->level() : g_config.compression_level;
+}
+
+void packer_t::account_compression(int level, uint64_t size, const level_control_t::start_t& start)
+{
+   stats_.level_sizes[std::min(std::max(level, 0), MaxCompressionLevel)] += size;
+
+   if (level_control_)
+      level_control_->update(start);
+}
+
+void packer_t::account_input(uint64_t size)
+{
+   if (level_control_)
+      level_control_->add_input(size);
 }
 
 void packer_t::write_header()
 {
    if (!header_is_written_)
    {
-      ostream_.write(FileHeader.data(), FileHeader.size());
+      std::array<char, ArchiveHeaderSize> header;
+      memcpy(header.data(), FileHeader.data(), FileHeader.size());
+      memcpy(header.data() + FileHeader.size(), &FormatVersion, sizeof(FormatVersion));
+
+      output_.write_at(output_.reserve(header.size()), header.data(), header.size());
       header_is_written_ = true;
    }
 }
 
+void packer_t::add_index_entry(const index_item_t& item)
+{
+   auto _ = timed_lock(index_mut_, stats_.index_lock);
+   append_index_entry(index_, item);
+   ++index_entries_;
+}
+
+void packer_t::write_index()
+{
+   phase_timer_t timer(stats_.index);
+
+   // entries of the archive we append to go first, the replaced ones are kept only as a source of links
+   std::vector<char> archive_index;
+   uint32_t archive_entries = 0;
+
+   for (auto& item : archive_items_)
+   {
+      if (replaced_names_.count(item.name))
+      {
+         if (item.status == node_hdr_t::estatus::Link)
+            continue;
+         item.hidden = true;
+      }
+      append_index_entry(archive_index, item);
+      ++archive_entries;
+   }
+
+   footer_t footer;
+   footer.index_size   = archive_index.size() + index_.size();
+
+   auto end_node = alloc_end_node_buf(footer.index_size);
+
+   footer.index_offset = output_.reserve(end_node.size() + footer.index_size + sizeof(footer)) + end_node.size();
+   footer.entries      = archive_entries + index_entries_;
+   footer.magic        = FooterMagic;
+
+   output_.write_at(footer.index_offset - end_node.size(), end_node.data(), end_node.size());
+
+   output_.write_at(footer.index_offset, archive_index.data(), archive_index.size());
+   output_.write_at(footer.index_offset + archive_index.size(), index_.data(), index_.size());
+
+   // the old footer stays the valid end of an appended archive until all the new part is on the disk
+   if (!archive_items_.empty())
+      output_.sync();
+
+   output_.write_at(footer.index_offset + footer.index_size, &footer, sizeof(footer));
+
+   index_.clear();
+   index_entries_ = 0;
+}
+
 void packer_t::write_file(metadata_ptr mt)
 {
    if (!mt->saved)
    {
       using namespace boost::interprocess;
+
+      if (is_solid_candidate(*mt))
+      {
+         auto _ = timed_lock(solid_mut_, stats_.solid_lock);
+         solid_files_.push_back(mt);
+         return;
+      }
+
       try
       {
-         file_mapping mapping(mt->name.string().c_str(), read_only);
-         mapped_region region(mapping, read_only);
+         file_mapping mapping;
+         mapped_region region;
+
+         if (mt->size > 0)
+         {
+            mapping = file_mapping(mt->name.string().c_str(), read_only);
+            region = mapped_region(mapping, read_only);
+         }
 
          const char* data = static_cast<const char*>(region.get_address());
          size_t data_size = region.get_size();
 
-         auto hdr_buf = alloc_file_node_buf(fs::relative(mt->name, input_folder_).string(), mt->id, mt->size);
-         std::vector<char> outbuffer;
+         const auto& name = mt->rel_name;
+
+         // a big file is never resident as a whole, the pages of every read piece are dropped
+         const bool big = data_size > g_config.chunk_size;
+
+         {
+            phase_timer_t timer(stats_.hash, data_size);
+
+            // every file of the archive has a digest, later appends find their content by it
+            bool need_digest = mt->digest == digest_t{};
+
+            hasher_t hasher;
+            uint32_t crc = 0;
+
+            for (size_t pos = 0; pos < data_size; pos += g_config.chunk_size)
+            {
+               auto piece = std::min(g_config.chunk_size, data_size - pos);
+
+               if (need_digest)
+                  hasher.update(data + pos, piece);
+
+               crc = crc32c(data + pos, piece, crc);
+
+               if (big)
+                  release_pages(data + pos, piece);
+            }
+
+            if (need_digest)
+            {
+               mt->digest = hasher.finish();
+
+               if (hash_cache_)
+                  hash_cache_->update(name, mt->stat, mt->digest);
+            }
+
+            mt->crc = crc;
+         }
+
+         bool compressible = mt->size > 0 && g_config.compression_level > 0;
 
-         if (mt->size > 0 && g_config.compression_level > 0)
+         // media and already compressed files are stored without a compression pass
+         if (compressible)
          {
-            outbuffer = compress_to_buffer(region.get_address(), mt->size, g_config.compression_level);
+            phase_timer_t timer(stats_.estimate, data_size);
+
+            if (!is_compressible(data, data_size))
+            {
+               compressible = false;
+               ++stats_.incompressible_files;
+               stats_.incompressible_size += mt->size;
+            }
+         }
+
+         if (compressible && mt->size > g_config.chunk_size)
+         {
+            if (write_chunked_file(mt, name, data))
+               return;
+
+            // the first window has not been worth compressing, the whole file is not compressed
+            // into a buffer of its size either
+            compressible = false;
+         }
+
+         auto hdr_buf = alloc_file_node_buf(name, mt->id, mt->size);
+         buffer_t outbuffer;
+         bool compressed = false;
+
+         if (compressible)
+         {
+            auto dictionary = find_dictionary(*mt);
+
+            // the dictionary is digested for the configured level
+            int level = dictionary ? g_config.compression_level : compression_level();
+            auto start = level_control_t::start();
+
+            {
+               phase_timer_t timer(stats_.compress, mt->size);
+               outbuffer = compress_to_buffer(region.get_address(), mt->size, level, dictionary);
+            }
+
+            account_compression(level, mt->size, start);
             if (outbuffer.size() > 0)
             {
-               hdr_buf = alloc_file_node_buf(fs::relative(mt->name, input_folder_).string(), mt->id, outbuffer.size(), true);
+               if (dictionary)
+                  ++stats_.dictionary_files;
+
+               hdr_buf = alloc_file_node_buf(name, mt->id, outbuffer.size(), true);
                data = outbuffer.data();
                data_size = outbuffer.size();
+               compressed = true;
             }
          }
 
-         std::unique_lock<std::mutex> _(ostream_mut_);
+         uint64_t offset = output_.reserve(hdr_buf.size() + data_size);
 
-         ostream_.write(hdr_buf.data(), hdr_buf.size());
-         ostream_.write(data, data_size);
+         output_.write_at(offset, hdr_buf.data(), hdr_buf.size());
+
+         if (big && !compressed)
+         {
+            // stored content goes from the mapping piece by piece
+            for (size_t pos = 0; pos < data_size; pos += g_config.chunk_size)
+            {
+               auto piece = std::min(g_config.chunk_size, data_size - pos);
+
+               output_.write_at(offset + hdr_buf.size() + pos, data + pos, piece);
+               release_pages(data + pos, piece);
+            }
+         }
+         else
+            output_.write_at(offset + hdr_buf.size(), data, data_size);
+
+         account_input(mt->size);
+
+         auto item = make_index_item(*mt, node_hdr_t::estatus::File, mt->id, offset, data_size);
+         item.compressed = compressed;
+         add_index_entry(item);
 
          mt->saved = true;
          ++stats_.saved_files;
+
+         write_links(mt, mt->id);
       }
       catch (const std::exception& e)
       {
          BTTF_ERROR() << "Exception :" << e.what();
+
+         if (!output_.failed())
+            promote_links(mt);
       }
    }
 }
 
+void packer_t::promote_links(metadata_ptr mt)
+{
+   // the first link becomes the origin for the rest if the file can't be saved
+   if (!mt->links.empty())
+   {
+      auto next = mt->links.front();
+      next->links.assign(std::next(mt->links.begin()), mt->links.end());
+      mt->links.clear();
+      write_file(next);
+   }
+}
+
+bool packer_t::is_solid_candidate(const metadata_t& mt) const
+{
+   return g_config.solid_block_size > 0 && g_config.compression_level > 0
+      && mt.size > 0 && mt.size * 4 <= g_config.solid_block_size;
+}
+
+static std::string extension_class(const fs::path& name)
+{
+   auto ext = name.extension().string();
+   std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+   return ext;
+}
+
+bool packer_t::is_dictionary_candidate(const metadata_t& mt) const
+{
+   return g_config.dictionary_size > 0 && g_config.compression_level > 0
+      && mt.size > 0 && mt.size <= DictionaryMaxFileSize && mt.size <= g_config.chunk_size && !is_solid_candidate(mt);
+}
+
+const dictionary_t* packer_t::find_dictionary(const metadata_t& mt) const
+{
+   if (!is_dictionary_candidate(mt))
+      return nullptr;
+
+   auto iter = dictionaries_.find(extension_class(mt.name));
+   return iter != dictionaries_.end() ? iter->second.get() : nullptr;
+}
+
+void packer_t::train_dictionaries()
+{
+   std::map<std::string, std::vector<metadata_ptr>> classes;
+
+   for (auto& group : files_list_)
+   {
+      for (auto& file : group.second)
+      {
+         if (is_dictionary_candidate(*file))
+            classes[extension_class(file->name)].push_back(file);
+      }
+   }
+
+   boost::asio::thread_pool pool;
+   std::mutex mut;
+
+   for (auto& cls : classes)
+   {
+      if (cls.second.size() < DictionaryMinSamples)
+         continue;
+
+      boost::asio::post(pool, [this, &cls, &mut]
+         {
+            phase_timer_t timer(stats_.dictionary);
+
+            auto& files = cls.second;
+
+            std::sort(files.begin(), files.end(), [](const metadata_ptr& a, const metadata_ptr& b)
+               {
+                  return a->rel_name < b->rel_name;
+               });
+
+            // samples are taken evenly over the sorted class up to the budget
+            uint64_t class_size = 0;
+            for (auto& file : files)
+               class_size += file->size;
+
+            size_t budget = g_config.dictionary_size * DictionarySamplesRatio;
+            size_t step = std::max<uint64_t>(1, class_size / budget);
+
+            std::vector<char> samples;
+            std::vector<size_t> sizes;
+
+            for (size_t i = 0; i < files.size() && samples.size() < budget; i += step)
+            {
+               try
+               {
+                  auto& file = files[i];
+
+                  fs::ifstream ifs;
+                  ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
+                  ifs.open(file->name, std::ios::binary);
+
+                  std::vector<char> sample(file->size);
+                  ifs.read(sample.data(), sample.size());
+
+                  samples.insert(samples.end(), sample.begin(), sample.end());
+                  sizes.push_back(sample.size());
+               }
+               catch (const std::exception& e)
+               {
+                  BTTF_DEBUG() << "reading of dictionary sample failed " << e.what();
+               }
+            }
+
+            if (sizes.size() < DictionaryMinSamples)
+               return;
+
+            auto content = train_dictionary(samples, sizes, g_config.dictionary_size);
+
+            if (content.empty())
+               return;
+
+            auto dictionary = std::make_shared<dictionary_t>(content.data(), content.size(), g_config.compression_level);
+
+            BTTF_DEBUG() << "dictionary for '" << cls.first << "' files: " << content.size() << " bytes from " << sizes.size() << " samples";
+
+            std::unique_lock<std::mutex> _(mut);
+            dictionaries_[cls.first] = dictionary;
+         });
+   }
+   pool.join();
+
+   // nodes are written in the order of classes to keep the archive reproducible
+   for (auto& dictionary : dictionaries_)
+      write_dictionary(*dictionary.second);
+}
+
+void packer_t::write_dictionary(const dictionary_t& dictionary)
+{
+   const auto& content = dictionary.content();
+
+   auto hdr_buf = alloc_file_node_buf(std::string(), 0, content.size());
+   reinterpret_cast<file_node_t*>(hdr_buf.data())->dictionary = true;
+
+   uint64_t offset = output_.reserve(hdr_buf.size() + content.size());
+
+   output_.write_at(offset, hdr_buf.data(), hdr_buf.size());
+   output_.write_at(offset + hdr_buf.size(), content.data(), content.size());
+
+   // the entry is hidden, it is not a file to extract
+   index_item_t item;
+   item.hidden     = true;
+   item.dictionary = true;
+   item.offset     = offset;
+   item.data_len   = content.size();
+   item.size       = content.size();
+   item.crc        = crc32c(content.data(), content.size());
+   add_index_entry(item);
+
+   ++stats_.dictionaries;
+}
+
+void packer_t::write_solid_blocks()
+{
+   // a file that can't be read passes its links to another file, which may get queued again
+   for (;;)
+   {
+      std::vector<metadata_ptr> files;
+      {
+         auto _ = timed_lock(solid_mut_, stats_.solid_lock);
+         files.swap(solid_files_);
+      }
+
+      if (files.empty())
+         break;
+
+      // files of the same kind from the same directory get into one block for better compression
+      std::sort(files.begin(), files.end(), [](const metadata_ptr& a, const metadata_ptr& b)
+         {
+            auto ext_a = a->name.extension();
+            auto ext_b = b->name.extension();
+
+            if (ext_a != ext_b)
+               return ext_a < ext_b;
+
+            return a->rel_name < b->rel_name;
+         });
+
+      boost::asio::thread_pool pool;
+
+      std::vector<metadata_ptr> block;
+      uint64_t block_size = 0;
+
+      // the content of a block and its compressed copy are in memory at once
+      auto post_block = [this, &pool, &block, &block_size]
+      {
+         post_task(pool, block_size + compress_bound(block_size), [this, block = std::move(block)]
+            {
+               write_block(block);
+            });
+         block.clear();
+         block_size = 0;
+      };
+
+      for (auto& file : files)
+      {
+         if (block_size + file->size > g_config.solid_block_size && !block.empty())
+            post_block();
+
+         block.push_back(file);
+         block_size += file->size;
+      }
+
+      if (!block.empty())
+         post_block();
+
+      pool.join();
+   }
+}
+
+void packer_t::write_block(const std::vector<metadata_ptr>& files)
+{
+   using namespace boost::interprocess;
+
+   uint64_t block_size = 0;
+   for (auto& mt : files)
+      block_size += mt->size;
+
+   buffer_t content(block_size);
+   size_t used = 0;
+
+   std::vector<metadata_ptr> members;
+   std::vector<uint64_t> offsets;
+
+   for (auto& mt : files)
+   {
+      try
+      {
+         file_mapping mapping(mt->name.string().c_str(), read_only);
+         mapped_region region(mapping, read_only);
+
+         auto data = static_cast<const char*>(region.get_address());
+
+         if (region.get_size() != mt->size)
+            throw std::runtime_error("size of the file has been changed");
+
+         {
+            phase_timer_t timer(stats_.hash, mt->size);
+
+            if (mt->digest == digest_t{})
+            {
+               mt->digest = hash_buffer(data, mt->size);
+
+               if (hash_cache_)
+                  hash_cache_->update(mt->rel_name, mt->stat, mt->digest);
+            }
+
+            mt->crc = crc32c(data, mt->size);
+         }
+
+         memcpy(content.data() + used, data, mt->size);
+         offsets.push_back(used);
+         members.push_back(mt);
+         used += mt->size;
+      }
+      catch (const std::exception& e)
+      {
+         BTTF_ERROR() << "Exception :" << e.what();
+
+         promote_links(mt);
+      }
+   }
+
+   if (members.empty())
+      return;
+
+   content.resize(used);
+
+   bool reserved = false;
+
+   try
+   {
+      solid_block_t header;
+      header.size = content.size();
+
+      int level = compression_level();
+      auto start = level_control_t::start();
+
+      buffer_t frame;
+      {
+         phase_timer_t timer(stats_.compress, content.size());
+         frame = compress_to_buffer(content.data(), content.size(), level);
+      }
+
+      account_compression(level, content.size(), start);
+      bool compressed = !frame.empty();
+
+      if (!compressed)
+         frame = std::move(content);
+
+      auto block_buf = alloc_file_node_buf(std::string(), 0, sizeof(header) + frame.size(), compressed);
+      reinterpret_cast<file_node_t*>(block_buf.data())->block = true;
+
+      // member nodes follow the block, the whole range is reserved at once
+      uint64_t members_size = 0;
+      for (auto& mt : members)
+         members_size += sizeof(file_node_t) + mt->rel_name.size() + sizeof(solid_ref_t);
+
+      uint64_t block_offset = output_.reserve(block_buf.size() + sizeof(header) + frame.size() + members_size);
+      reserved = true;
+
+      output_.write_at(block_offset, block_buf.data(), block_buf.size());
+      output_.write_at(block_offset + block_buf.size(), &header, sizeof(header));
+      output_.write_at(block_offset + block_buf.size() + sizeof(header), frame.data(), frame.size());
+
+      std::vector<char> nodes;
+      uint64_t offset = block_offset + block_buf.size() + sizeof(header) + frame.size();
+
+      for (size_t i = 0; i < members.size(); ++i)
+      {
+         auto& mt = members[i];
+
+         solid_ref_t ref;
+         ref.block_offset = block_offset;
+         ref.offset       = offsets[i];
+         ref.size         = mt->size;
+
+         auto hdr_buf = alloc_file_node_buf(mt->rel_name, mt->id, sizeof(ref), compressed);
+         reinterpret_cast<file_node_t*>(hdr_buf.data())->solid = true;
+
+         auto item = make_index_item(*mt, node_hdr_t::estatus::File, mt->id, offset + nodes.size(), sizeof(ref));
+         item.compressed = compressed;
+         item.solid = true;
+         add_index_entry(item);
+
+         nodes.insert(nodes.end(), hdr_buf.begin(), hdr_buf.end());
+         nodes.insert(nodes.end(), reinterpret_cast<const char*>(&ref), reinterpret_cast<const char*>(&ref) + sizeof(ref));
+      }
+
+      output_.write_at(offset, nodes.data(), nodes.size());
+
+      account_input(header.size);
+
+      for (auto& mt : members)
+      {
+         mt->saved = true;
+         ++stats_.saved_files;
+      }
+      ++stats_.solid_blocks;
+      stats_.solid_files += members.size();
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "Exception :" << e.what();
+
+      if (reserved)
+         output_.fail();
+      return;
+   }
+
+   for (auto& mt : members)
+      write_links(mt, mt->id);
+}
+
+bool packer_t::write_chunked_file(metadata_ptr mt, const std::string& name, const char* data)
+{
+   using frame_future = std::future<buffer_t>;
+
+   const uint64_t chunk_size = g_config.chunk_size;
+   const uint32_t frames     = static_cast<uint32_t>((mt->size + chunk_size - 1) / chunk_size);
+   const uint32_t window     = frame_window();
+
+   // frames are compressed in parallel, at most two windows of the file are mapped at once
+   auto compress_window = [&](uint32_t first)
+   {
+      std::vector<frame_future> window_frames;
+
+      for (auto i = first; i < frames && i < first + window; ++i)
+      {
+         auto offset = i * chunk_size;
+         auto size   = std::min(chunk_size, mt->size - offset);
+
+         // every frame takes the level current when it starts
+         auto task = std::make_shared<std::packaged_task<buffer_t()>>([this, data, offset, size]
+            {
+               stats_.frame_queue.pop();
+
+               int level = compression_level();
+               auto start = level_control_t::start();
+
+               phase_timer_t timer(stats_.compress, size);
+               auto frame = compress_frame(data + offset, size, level);
+
+               account_compression(level, size, start);
+               return frame;
+            });
+
+         window_frames.push_back(task->get_future());
+         stats_.frame_queue.push();
+         boost::asio::post(*frames_pool_, [task] { (*task)(); });
+      }
+      return window_frames;
+   };
+
+   // the frames refer to the mapped file, so all of them must be finished before leaving;
+   // the pages of the compressed frames are dropped, the file is never resident as a whole
+   auto collect = [&](std::vector<frame_future>& window_frames, uint32_t first)
+   {
+      std::vector<buffer_t> result;
+      try
+      {
+         for (auto& frame : window_frames)
+            result.push_back(frame.get());
+      }
+      catch (...)
+      {
+         for (auto& frame : window_frames)
+            if (frame.valid())
+               frame.wait();
+         throw;
+      }
+
+      auto offset = first * chunk_size;
+      release_pages(data + offset, std::min(uint64_t(result.size()) * chunk_size, mt->size - offset));
+
+      return result;
+   };
+
+   auto pending = compress_window(0);
+   auto ready = collect(pending, 0);
+
+   uint64_t ready_size = 0;
+   for (const auto& frame : ready)
+      ready_size += frame.size();
+
+   // the first window decides whether the file is worth compressing at all
+   if (ready_size >= std::min<uint64_t>(mt->size, uint64_t(window) * chunk_size))
+      return false;
+
+   // the whole file is compressed before its range is reserved, so the range is reserved
+   // at once and the other writers never wait for the frames
+   uint32_t next = static_cast<uint32_t>(ready.size()); // the first frame of the pending window
+   pending = compress_window(next);
+
+   try
+   {
+      while (!pending.empty())
+      {
+         auto done = collect(pending, next);
+         next += static_cast<uint32_t>(done.size());
+         pending = compress_window(next);
+
+         for (auto& frame : done)
+         {
+            ready_size += frame.size();
+            ready.push_back(std::move(frame));
+         }
+      }
+   }
+   catch (...)
+   {
+      // the pending frames refer to the mapped file
+      for (auto& frame : pending)
+         if (frame.valid())
+            frame.wait();
+      throw;
+   }
+
+   frame_table_t header;
+   header.size       = mt->size;
+   header.chunk_size = static_cast<uint32_t>(chunk_size);
+   header.frames     = frames;
+
+   // the frames follow the node in order, every one prefixed by its length, so the archive
+   // is read forward only the same way whether it is a file or a stream
+   std::vector<char> node = alloc_file_node_buf(name, mt->id, sizeof(header), true, true);
+   node.insert(node.end(), reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header) + sizeof(header));
+
+   uint64_t frames_size = ready.size() * sizeof(inline_frame_t) + ready_size;
+   uint64_t data_len    = sizeof(header) + frames_size;
+   uint64_t offset      = output_.reserve(node.size() + frames_size);
+
+   // a failure after the reservation leaves a range nobody writes
+   try
+   {
+      output_.write_at(offset, node.data(), node.size());
+
+      uint64_t frame_offset = offset + node.size();
+      uint64_t input        = 0; // the source bytes of the frames written
+
+      for (const auto& frame : ready)
+      {
+         inline_frame_t prefix;
+         prefix.len = frame.size();
+
+         output_.write_at(frame_offset, &prefix, sizeof(prefix));
+         output_.write_at(frame_offset + sizeof(prefix), frame.data(), frame.size());
+
+         frame_offset += sizeof(prefix) + frame.size();
+
+         auto size = std::min<uint64_t>(chunk_size, mt->size - input);
+         account_input(size);
+         input += size;
+      }
+   }
+   catch (...)
+   {
+      output_.fail();
+      throw;
+   }
+
+   auto item = make_index_item(*mt, node_hdr_t::estatus::File, mt->id, offset, data_len);
+   item.compressed = true;
+   item.chunked = true;
+   add_index_entry(item);
+
+   mt->saved = true;
+   ++stats_.saved_files;
+   ++stats_.chunked_files;
+
+   write_links(mt, mt->id);
+
+   return true;
+}
+
 void packer_t::write_link(metadata_ptr mt, int other_id)
 {
    if (!mt->saved)
    {
-      auto buffer = alloc_link_node_buf(fs::relative(mt->name, input_folder_).string(), other_id);
+      auto buffer = alloc_link_node_buf(mt->rel_name, other_id);
 
-      std::unique_lock<std::mutex> _(ostream_mut_);
+      uint64_t offset = output_.reserve(buffer.size());
 
-      ostream_.write(buffer.data(), buffer.size());
+      output_.write_at(offset, buffer.data(), buffer.size());
+
+      add_index_entry(make_index_item(*mt, node_hdr_t::estatus::Link, other_id, offset, 0));
 
       mt->saved = true;
       ++stats_.saved_links;
+
+      write_links(mt, other_id);
+   }
+}
+
+void packer_t::write_links(metadata_ptr mt, int other_id)
+{
+   for (auto& link : mt->links)
+   {
+      link->digest = mt->digest;
+      write_link(link, other_id);
    }
 }
 
 void packer_t::process_file_group(std::vector<metadata_ptr>& vec)
 {
-   while (!vec.empty())
+   // all files of the group have the same size and digest, the first one is the origin for others
+   std::sort(vec.begin(), vec.end(), [](const metadata_ptr& a, const metadata_ptr& b)
+      {
+         return a->id < b->id;
+      });
+
+   // the content is already in the archive we append to
+   auto existing = archive_files_.find({ vec.front()->digest, vec.front()->size });
+
+   if (existing != archive_files_.end())
    {
-      auto file = vec.front();
-      write_file(file);
-      vec.erase(vec.begin());
+      const auto& item = archive_items_[existing->second];
 
-      for (auto iter = vec.begin(); iter != vec.end(); )
+      if (equal_to_archive(*vec.front(), item))
+      {
+         for (auto& file : vec)
+            write_link(file, item.file_id);
+         return;
+      }
+      BTTF_WARN() << "file '" << vec.front()->name.string() << "' has the digest of '" << item.name << "' of the archive but different content";
+   }
+
+   auto origin = vec.front();
+
+   for (auto iter = std::next(vec.begin()); iter != vec.end(); ++iter)
+   {
+      auto& file = *iter;
+      bool equal = true;
+
+      if (g_config.verify_duplicates)
       {
          try
          {
-            if (equal_files((*iter)->name, file->name))
-            {
-               write_link(*iter, file->id);
-               iter = vec.erase(iter);
-            }
-            else
-               ++iter;
+            phase_timer_t timer(stats_.compare, file->size);
+            equal = equal_files(file->name, origin->name);
          }
          catch (const std::exception& e)
          {
-            BTTF_WARN() << "comparing of files '" << file->name << "' and '" << (*iter)->name << "' failed " << e.what();
-            iter = vec.erase(iter);
+            BTTF_WARN() << "comparing of files '" << origin->name.string() << "' and '" << file->name.string() << "' failed " << e.what();
+            equal = false;
          }
       }
+
+      if (equal)
+         origin->links.push_back(file);
+      else
+      {
+         BTTF_WARN() << "files '" << origin->name.string() << "' and '" << file->name.string() << "' have the same digest but different content";
+         write_file(file);
+      }
+   }
+
+   // the links are written right after the origin, which may be postponed to a solid block
+   write_file(origin);
+}
+
+bool packer_t::equal_to_archive(const metadata_t& mt, const index_item_t& item)
+{
+   // the digest is trusted without --verify-duplicates
+   if (!archive_content_)
+      return true;
+
+   using namespace boost::interprocess;
+
+   try
+   {
+      phase_timer_t timer(stats_.compare, mt.size);
+
+      if (mt.size == 0)
+         return archive_content_->equal(item, nullptr, 0);
+
+      file_mapping mapping(mt.name.string().c_str(), read_only);
+      mapped_region region(mapping, read_only);
+
+      return archive_content_->equal(item, static_cast<const char*>(region.get_address()), region.get_size());
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_WARN() << "comparing of file '" << mt.name.string() << "' with '" << item.name << "' of the archive failed " << e.what();
    }
+   return false;
 }
 
 } // namespace bttf
@@ -1,15 +1,34 @@
 #pragma once
 
 #include "structure.h"
+#include "utilities.h"
+#include "index.h"
+#include "compress.h"
+#include "output_file.h"
+#include "level_control.h"
+#include "metrics.h"
+#include "inflight_limit.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/asio/thread_pool.hpp>
 
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <functional>
 
 namespace bttf {
 
+static const int MaxCompressionLevel = 9;
+
 struct metadata_t;
+struct hash_cache_t;
+struct archive_content_t;
 
 using metadata_ptr = std::shared_ptr<metadata_t>;
 
@@ -20,37 +39,126 @@ struct packer_stats_t
    std::atomic<size_t> total_size   = 0;
    std::atomic<size_t> saved_files  = 0;
    std::atomic<size_t> saved_links  = 0;
+   std::atomic<size_t> chunked_files = 0;
+   std::atomic<size_t> hashed_files  = 0;
+   std::atomic<size_t> cached_digests = 0;
+   std::atomic<size_t> unchanged_files = 0;
+   std::atomic<size_t> hardlinks     = 0;
+   std::atomic<size_t> solid_blocks  = 0;
+   std::atomic<size_t> solid_files   = 0;
+   std::atomic<size_t> dictionaries  = 0;
+   std::atomic<size_t> dictionary_files = 0;
+   std::atomic<size_t> contexts      = 0; // zstd contexts created by the packing threads
+   std::atomic<size_t> buffer_allocations = 0;
+   std::atomic<size_t> buffer_reuses = 0;
+   std::atomic<size_t> incompressible_files = 0; // stored without a compression pass by the sampled estimate
+   std::atomic<size_t> incompressible_size  = 0;
+   std::array<std::atomic<size_t>, MaxCompressionLevel + 1> level_sizes = {}; // input bytes compressed at every level
+   std::atomic<size_t> level_changes = 0; // done by the adaptive level
+
+   // where the time goes, reported by --stats-json
+   phase_stats_t    scan;
+   phase_stats_t    hash;        // digests and crcs of the content
+   phase_stats_t    compare;     // byte comparison of duplicates
+   phase_stats_t    estimate;    // sampled compressibility checks
+   phase_stats_t    dictionary;  // training of dictionaries
+   phase_stats_t    compress;
+   phase_stats_t    index;
+   lock_stats_t     files_lock;
+   lock_stats_t     index_lock;
+   lock_stats_t     solid_lock;
+   lock_stats_t     inflight;    // tasks waiting for the memory budget before they are posted
+   queue_stats_t    inflight_bytes; // bytes of the budget taken, the peak is max_depth
+   queue_stats_t    file_queue;  // files, groups of duplicates and solid blocks waiting for a packing thread
+   queue_stats_t    frame_queue; // frames of big files waiting for a compressing thread
+   size_histogram_t file_sizes;
 };
 
 struct packer_t
 {
    packer_t(const boost::filesystem::path& input_folder, const boost::filesystem::path& archive);
+   ~packer_t();
 
    const packer_stats_t& stats() const
    {
       return stats_;
    }
 
+   const output_file_stats_t& output_stats() const
+   {
+      return output_.stats();
+   }
+
 private:
    void pack();
    size_t scan_folder();
+   void add_file(const boost::filesystem::path& file_name, std::string rel_name, const file_stat_t& st, int& file_counter,
+      std::map<std::pair<uint64_t, uint64_t>, metadata_ptr>& inodes);
 
    void process_file_group(std::vector<metadata_ptr>& vec);
+   bool equal_to_archive(const metadata_t& mt, const index_item_t& item);
 
    void write_link(metadata_ptr mt, int other_id);
+   void write_links(metadata_ptr mt, int other_id);
+   void promote_links(metadata_ptr mt);
+
+   bool is_solid_candidate(const metadata_t& mt) const;
+   void write_solid_blocks();
+   void write_block(const std::vector<metadata_ptr>& files);
+
+   bool is_dictionary_candidate(const metadata_t& mt) const;
+   const dictionary_t* find_dictionary(const metadata_t& mt) const;
+   void train_dictionaries();
+   void write_dictionary(const dictionary_t& dictionary);
    void write_file(metadata_ptr mt);
+   bool write_chunked_file(metadata_ptr mt, const std::string& name, const char* data);
+   uint32_t frame_window() const;
+   uint64_t inflight_size(const metadata_t& mt) const;
+   void post_task(boost::asio::thread_pool& pool, uint64_t size, std::function<void()> task);
+   int compression_level() const;
+   void account_compression(int level, uint64_t size, const level_control_t::start_t& start);
+   void account_input(uint64_t size); // source bytes written to the archive, compressed or stored
    void write_header();
+   void open_archive(const boost::filesystem::path& archive);
+   void add_index_entry(const index_item_t& item);
+   void write_index();
 
 private:
    const boost::filesystem::path& input_folder_;
 
-   std::map<std::pair<size_t, uint32_t>, std::vector<metadata_ptr>> files_list_;
+   std::map<std::pair<digest_t, uint64_t>, std::vector<metadata_ptr>> files_list_; // files grouped by {digest, size}
    std::mutex files_mut_;
 
    bool header_is_written_ = false;
 
-   std::mutex ostream_mut_;
-   boost::filesystem::ofstream ostream_;
+   output_file_t output_;
+
+   std::mutex index_mut_;
+
+   std::vector<char> index_;      // guarded by index_mut_
+   uint32_t index_entries_ = 0;
+
+   std::unique_ptr<boost::asio::thread_pool> frames_pool_; // compresses frames of large files
+
+   std::unique_ptr<inflight_limit_t> inflight_; // file data being packed, taken before a task is posted
+
+   std::unique_ptr<hash_cache_t> hash_cache_;
+
+   std::unique_ptr<level_control_t> level_control_; // only with a target speed
+
+   std::mutex solid_mut_;
+   std::vector<metadata_ptr> solid_files_; // small files postponed to solid blocks
+
+   std::map<std::string, dictionary_ptr> dictionaries_; // by extension class, read-only after training
+
+   // content of the archive we append to
+   std::vector<index_item_t>                        archive_items_;
+   std::unordered_map<std::string, size_t>          archive_names_;  // live entry name -> archive_items_ position
+   std::map<std::pair<digest_t, uint64_t>, size_t>  archive_files_;  // {digest, size} -> archive_items_ position
+   std::unique_ptr<archive_content_t>               archive_content_; // new files are byte-compared with it, if verifying
+   std::set<uint64_t>                               archive_sizes_;
+   std::unordered_set<std::string>                  replaced_names_;
+   int                                              first_id_ = 0;   // new files get ids after this one
 
    packer_stats_t stats_;
 };
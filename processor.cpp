@@ -1,25 +1,235 @@
 #include "processor.h"
 #include "packer.h"
 #include "unpacker.h"
+#include "index.h"
+#include "compress.h"
 #include "trace.h"
+#include "config.h"
+#include "metrics.h"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <iostream>
+#include <unordered_map>
+#include <chrono>
 
 namespace bttf {
 
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+}
+
+static void write_stats(const packer_t& packer, double elapsed)
+{
+   boost::filesystem::ofstream out(g_config.stats_json);
+
+   if (!out)
+   {
+      BTTF_ERROR() << "can't open the stats file " << g_config.stats_json;
+      return;
+   }
+
+   auto& s = packer.stats();
+   auto& o = packer.output_stats();
+
+   json_writer_t json(out);
+   json.begin();
+   json.value("operation", std::string("pack"));
+   json.value("elapsed_ms", elapsed);
+
+   json.begin("counters");
+   json.value("files", uint64_t(s.files));
+   json.value("input_bytes", uint64_t(s.total_size));
+   json.value("output_bytes", uint64_t(s.output_size));
+   json.value("written_bytes", uint64_t(o.write.bytes));
+   json.value("saved_files", uint64_t(s.saved_files));
+   json.value("saved_links", uint64_t(s.saved_links));
+   json.value("hashed_files", uint64_t(s.hashed_files));
+   json.value("cached_digests", uint64_t(s.cached_digests));
+   json.value("unchanged_files", uint64_t(s.unchanged_files));
+   json.value("hardlinks", uint64_t(s.hardlinks));
+   json.value("solid_blocks", uint64_t(s.solid_blocks));
+   json.value("solid_files", uint64_t(s.solid_files));
+   json.value("dictionaries", uint64_t(s.dictionaries));
+   json.value("dictionary_files", uint64_t(s.dictionary_files));
+   json.value("incompressible_files", uint64_t(s.incompressible_files));
+   json.value("incompressible_bytes", uint64_t(s.incompressible_size));
+   json.value("level_changes", uint64_t(s.level_changes));
+   json.value("zstd_contexts", uint64_t(s.contexts));
+   json.value("buffer_allocations", uint64_t(s.buffer_allocations));
+   json.value("buffer_reuses", uint64_t(s.buffer_reuses));
+   json.end();
+
+   // input bytes compressed at every level, the levels not used are left out
+   json.begin("level_sizes");
+   for (int level = 0; level <= MaxCompressionLevel; ++level)
+   {
+      if (s.level_sizes[level] > 0)
+         json.value(std::to_string(level).c_str(), uint64_t(s.level_sizes[level]));
+   }
+   json.end();
+
+   json.begin("phases");
+   json.value("scan", s.scan);
+   json.value("hash", s.hash);
+   json.value("compare", s.compare);
+   json.value("estimate", s.estimate);
+   json.value("dictionary", s.dictionary);
+   json.value("compress", s.compress);
+   json.value("write", o.write);
+   json.value("index", s.index);
+   json.end();
+
+   json.begin("locks");
+   json.value("files", s.files_lock);
+   json.value("index", s.index_lock);
+   json.value("solid", s.solid_lock);
+   json.value("inflight", s.inflight);
+   json.value("stream", o.stream_lock);
+   json.value("stream_pending", o.pending_wait);
+   json.end();
+
+   json.begin("queues");
+   json.value("files", s.file_queue);
+   json.value("frames", s.frame_queue);
+   json.value("inflight_bytes", s.inflight_bytes);
+   json.value("stream_pending_bytes", o.pending);
+   json.end();
+
+   json.value("file_sizes", s.file_sizes);
+   json.end();
+}
+
+static void write_stats(const unpacker_t& unpacker, double elapsed)
+{
+   boost::filesystem::ofstream out(g_config.stats_json);
+
+   if (!out)
+   {
+      BTTF_ERROR() << "can't open the stats file " << g_config.stats_json;
+      return;
+   }
+
+   auto& s = unpacker.stats();
+   auto buffers = buffer_pool_stats();
+
+   json_writer_t json(out);
+   json.begin();
+   json.value("operation", std::string("unpack"));
+   json.value("elapsed_ms", elapsed);
+
+   json.begin("counters");
+   json.value("files", uint64_t(s.files));
+   json.value("links", uint64_t(s.links));
+   json.value("kernel_copies", uint64_t(s.kernel_copies));
+   json.value("zstd_contexts", uint64_t(compression_contexts()));
+   json.value("buffer_allocations", uint64_t(buffers.allocations));
+   json.value("buffer_reuses", uint64_t(buffers.reuses));
+   json.end();
+
+   json.begin("phases");
+   json.value("index", s.index);
+   json.value("mkdir", s.mkdir);
+   json.value("read", s.read);
+   json.value("decompress", s.decompress);
+   json.value("write", s.write);
+   json.value("link", s.link);
+   json.end();
+
+   json.begin("locks");
+   json.value("inflight", s.inflight);
+   json.end();
+
+   json.begin("queues");
+   json.value("files", s.file_queue);
+   json.value("frames", s.frame_queue);
+   json.end();
+
+   json.value("file_sizes", s.file_sizes);
+   json.end();
+}
+
 void pack_folder(const boost::filesystem::path& folder, const boost::filesystem::path& output_name)
 {
+   auto start = std::chrono::steady_clock::now();
+
    packer_t packer(folder, output_name);
 
-   auto osize = boost::filesystem::file_size(output_name);
+   if (!g_config.stats_json.empty())
+      write_stats(packer, elapsed_ms(start));
 
    auto& s = packer.stats();
 
+   size_t osize = s.output_size;
+
    BTTF_INFO() << "input files " << s.files << ", input size:" << s.total_size << ", output size:" << osize << ", ratio:" << 
-	(osize * 100 / s.total_size) << "%, saved files:" << s.saved_files << ", saved links:" << s.saved_links;
+	(s.total_size ? osize * 100 / s.total_size : 100) << "%, saved files:" << s.saved_files << ", saved links:" << s.saved_links
+	<< ", hashed files:" << s.hashed_files << ", cached digests:" << s.cached_digests << ", unchanged files:" << s.unchanged_files << ", hardlinks:" << s.hardlinks
+	<< ", solid blocks:" << s.solid_blocks << ", solid files:" << s.solid_files
+	<< ", dictionaries:" << s.dictionaries << ", dictionary files:" << s.dictionary_files
+	<< ", incompressible files:" << s.incompressible_files << ", incompressible size:" << s.incompressible_size
+	<< ", zstd contexts:" << s.contexts << ", buffer allocations:" << s.buffer_allocations << ", buffer reuses:" << s.buffer_reuses
+	<< ", level changes:" << s.level_changes;
+
+   for (int level = 1; level <= MaxCompressionLevel; ++level)
+   {
+      if (s.level_sizes[level] > 0)
+         BTTF_INFO() << "compression level " << level << ": input size " << s.level_sizes[level];
+   }
 }
 
 void unpack_file(const boost::filesystem::path& input_name, const boost::filesystem::path& output_folder)
 {
+   auto start = std::chrono::steady_clock::now();
+
    unpacker_t unpacker(input_name, output_folder);
+
+   if (!g_config.stats_json.empty())
+      write_stats(unpacker, elapsed_ms(start));
+
+   auto buffers = buffer_pool_stats();
+
+   BTTF_DEBUG() << "zstd contexts:" << compression_contexts() << ", buffer allocations:" << buffers.allocations << ", buffer reuses:" << buffers.reuses;
+}
+
+void list_file(const boost::filesystem::path& input_name)
+{
+   auto items = read_index(input_name);
+
+   std::unordered_map<int, const index_item_t*> files;
+
+   size_t file_count = 0;
+   size_t link_count = 0;
+   size_t dictionary_count = 0;
+
+   for (const auto& item : items)
+   {
+      if (item.status == node_hdr_t::estatus::File)
+         files[item.file_id] = &item;
+
+      if (item.hidden)
+      {
+         dictionary_count += item.dictionary;
+         continue;
+      }
+
+      if (item.status == node_hdr_t::estatus::File)
+      {
+         ++file_count;
+         std::cout << "F " << (item.solid ? "s " : item.chunked ? "c " : item.compressed ? "z " : "- ") << item.size << "\t" << item.data_len << "\t" << item.name << "\n";
+      }
+      else
+      {
+         ++link_count;
+         auto iter = files.find(item.file_id);
+         std::cout << "L - " << item.size << "\t" << 0 << "\t" << item.name << " -> " << (iter != files.end() ? iter->second->name : "?") << "\n";
+      }
+   }
+   std::cout.flush();
+
+   BTTF_INFO() << "files " << file_count << ", links " << link_count << ", replaced " << (items.size() - file_count - link_count - dictionary_count)
+      << ", dictionaries " << dictionary_count;
 }
 
 } // namespace bttf
@@ -8,4 +8,6 @@ void pack_folder(const boost::filesystem::path& input_folder, const boost::files
 
 void unpack_file(const boost::filesystem::path& file_from, const boost::filesystem::path& folder_to);
 
+void list_file(const boost::filesystem::path& file_from);
+
 } // namespace bttf
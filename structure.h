@@ -1,8 +1,12 @@
 #pragma once
 
+#include "hash.h"
+
 #include <vector>
 #include <array>
 #include <string>
+#include <cstdint>
+#include <cstring>
 
 namespace bttf {
 
@@ -16,44 +20,148 @@ struct node_hdr_t
 
    uint32_t status     : 1;  // File or Link
    uint32_t compressed : 1;  // use external compressor
+   uint32_t chunked    : 1;  // data is a set of independent frames, see frame_table_t
    uint32_t name_len   : 10; // up to 1K
-   uint32_t file_id    : 20; // id of this file or id of other file if link
+   uint32_t hidden     : 1;  // index only: entry is replaced by a newer one and kept as a source of links
+   uint32_t block      : 1;  // node is a solid block of small files, it has no name
+   uint32_t solid      : 1;  // file data is solid_ref_t to a block containing the file
+   uint32_t dictionary : 1;  // node is a zstd dictionary, it has no name
+   uint32_t end        : 1;  // node has no name, its data is the index and the footer
+   uint32_t reserved   : 14;
+   uint32_t file_id;         // id of this file or id of other file if link
 };
 
 struct file_node_t : node_hdr_t
 {
-   uint32_t data_len;
+   uint64_t data_len;
    char     name[/* name_len */];
  /*char     data[ data_len ]; */
 };
 
+// data of a chunked node, every frame is compressed independently;
+// the frames follow the node in order, see inline_frame_t
+struct frame_table_t
+{
+   uint64_t size;       // original size of the file
+   uint32_t chunk_size; // original size of every frame but the last one
+   uint32_t frames;
+};
+
+// every frame after a chunked node is prefixed by its length
+struct inline_frame_t
+{
+   uint64_t len;
+ /*char     frame[ len ]; */
+};
+
+// location of a frame in the archive, see frame_refs()
+struct frame_ref_t
+{
+   uint64_t offset;     // offset of the frame from the beginning of the archive
+   uint64_t len;
+};
+
+// data of a block node, small files are concatenated and compressed as one frame
+struct solid_block_t
+{
+   uint64_t size;       // original size of the block
+ /*char     frame[]; */
+};
+
+// data of a file stored in a solid block
+struct solid_ref_t
+{
+   uint64_t block_offset; // offset of the block node from the beginning of the archive
+   uint64_t offset;       // offset of the file in the original block
+   uint64_t size;
+};
+
 struct link_node_t : node_hdr_t
 {
    char     name[/* name_len */];
 };
 
+// central directory entry, the index is written after all nodes
+struct index_entry_t : node_hdr_t
+{
+   uint64_t offset;   // offset of the node from the beginning of the archive
+   uint64_t data_len; // length of node data, 0 for links
+   uint64_t size;     // original size of the file
+   int64_t  mtime;    // modification time of the source file, ns
+   digest_t digest;   // content digest of the file
+   uint32_t crc;      // crc32c of the original content of file and dictionary entries
+   char     name[/* name_len */];
+};
+
+// fixed-size footer at the very end of the archive, the end of the end node data
+struct footer_t
+{
+   uint64_t            index_offset;
+   uint64_t            index_size;
+   uint32_t            entries;
+   std::array<char, 4> magic;
+};
+
+// nodes of the archives written before the format had a version, they are only read:
+// "BTTF" is followed right by the nodes, there is no index
+struct legacy_node_hdr_t
+{
+   uint32_t status     : 1;  // File or Link
+   uint32_t compressed : 1;  // a single zstd frame
+   uint32_t name_len   : 10; // never 0 in the first node, so the header is not taken for a version
+   uint32_t file_id    : 20; // id of this file or id of other file if link
+};
+
+struct legacy_file_node_t : legacy_node_hdr_t
+{
+   uint32_t data_len;
+   char     name[/* name_len */];
+ /*char     data[ data_len ]; */
+};
+
+struct legacy_link_node_t : legacy_node_hdr_t
+{
+   char     name[/* name_len */];
+};
+
 #pragma pack (pop)
 
-inline void init_hdr(node_hdr_t* hdr, node_hdr_t::estatus s, const std::string& file_name, int id, bool compressed)
+inline void init_hdr(node_hdr_t* hdr, node_hdr_t::estatus s, const std::string& file_name, int id, bool compressed, bool chunked = false)
 {
    hdr->status = s;
    hdr->compressed = compressed;
+   hdr->chunked = chunked;
+   hdr->hidden = false;
+   hdr->block = false;
+   hdr->solid = false;
+   hdr->dictionary = false;
+   hdr->end = false;
+   hdr->reserved = 0;
    hdr->file_id = id;
    hdr->name_len = file_name.size();
 }
 
-inline std::vector<char> alloc_file_node_buf(const std::string& file_name, int id, uint32_t data_len, bool compressed = false)
+inline std::vector<char> alloc_file_node_buf(const std::string& file_name, int id, uint64_t data_len, bool compressed = false, bool chunked = false)
 {
    std::vector<char> buffer(sizeof(file_node_t) + file_name.size());
 
    auto node = reinterpret_cast<file_node_t*>(buffer.data());
-   init_hdr(node, node_hdr_t::estatus::File, file_name, id, compressed);
+   init_hdr(node, node_hdr_t::estatus::File, file_name, id, compressed, chunked);
    memcpy(node->name, file_name.c_str(), file_name.size());
    node->data_len = data_len;
 
    return buffer;
 }
 
+// the last node of the nodes written at once, followed by the index and the footer as its data;
+// an appended archive has one after every part, only the last one is referred to by the end of the file
+inline std::vector<char> alloc_end_node_buf(uint64_t index_size)
+{
+   auto buffer = alloc_file_node_buf(std::string(), 0, index_size + sizeof(footer_t));
+   reinterpret_cast<file_node_t*>(buffer.data())->end = true;
+   return buffer;
+}
+
 inline std::vector<char> alloc_link_node_buf(const std::string& file_name, int id)
 {
    std::vector<char> buffer(sizeof(link_node_t) + file_name.size());
@@ -66,5 +174,9 @@ inline std::vector<char> alloc_link_node_buf(const std::string& file_name, int i
 }
 
 const std::array<char, 4> FileHeader = { {'B', 'T', 'T', 'F'} };
+const uint32_t            FormatVersion = 1; // written right after FileHeader
+const uint32_t            LegacyFormatVersion = 0; // archives without a version, see legacy_node_hdr_t
+const size_t              ArchiveHeaderSize = FileHeader.size() + sizeof(FormatVersion);
+const std::array<char, 4> FooterMagic = { {'B', 'T', 'T', 'I'} };
 
 } // namespace bttf
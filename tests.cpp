@@ -0,0 +1,282 @@
+// tests of packing over generated trees, every test is run by ctest by its name:
+//    BackToTheFutureTests [test name] [--work-dir folder]
+//
+// the trees are generated from fixed seeds, so a test sees the same input on every run
+
+#include "packer.h"
+#include "unpacker.h"
+#include "index.h"
+#include "utilities.h"
+#include "config.h"
+
+#include <boost/filesystem.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+namespace bttf {
+
+config_t g_config;
+
+} // namespace bttf
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+#define CHECK(condition, message)                                                        \
+   do                                                                                    \
+   {                                                                                     \
+      if (!(condition))                                                                  \
+      {                                                                                  \
+         std::ostringstream out;                                                         \
+         out << __FILE__ << ":" << __LINE__ << ": " << #condition << ": " << message;    \
+         throw std::runtime_error(out.str());                                            \
+      }                                                                                  \
+   } while (false)
+
+// words of a small vocabulary, compresses well and takes zstd some time on high levels
+std::string make_text(std::mt19937_64& rng, size_t size)
+{
+   static const char* words[] = {
+      "archive", "the", "of", "future", "back", "to", "file", "node", "index", "frame", "block", "data",
+      "compress", "level", "stream", "a", "and", "with", "for", "size", "offset", "digest", "link", "tree"
+   };
+
+   std::string result;
+   result.reserve(size + 16);
+
+   while (result.size() < size)
+   {
+      result += words[rng() % (sizeof(words) / sizeof(words[0]))];
+      result += ' ';
+      result += std::to_string(rng() % 100000);
+      result += (rng() % 8 == 0) ? '\n' : ' ';
+   }
+
+   result.resize(size);
+   return result;
+}
+
+void write_file(const fs::path& path, const std::string& content)
+{
+   fs::create_directories(path.parent_path());
+
+   std::ofstream ofs(path.string(), std::ios::binary);
+   ofs.write(content.data(), content.size());
+   if (!ofs)
+      throw std::runtime_error("can't write " + path.string());
+}
+
+// every file of the tree is unpacked with the same content
+void check_unpacked(const fs::path& tree, const fs::path& archive, const fs::path& output)
+{
+   fs::remove_all(output);
+   {
+      bttf::unpacker_t unpacker(archive, output);
+   }
+
+   size_t files = 0;
+
+   for (const auto& entry : fs::recursive_directory_iterator(tree))
+   {
+      if (!fs::is_regular_file(entry.status()))
+         continue;
+
+      auto rel = fs::relative(entry.path(), tree);
+      CHECK(bttf::equal_files(entry.path(), output / rel), "'" << rel.string() << "' is unpacked with other content");
+      ++files;
+   }
+   CHECK(files > 0, "the tree is empty");
+}
+
+// two big chunked files among many small ones: a big file reserves its range only when it is compressed,
+// so the small files written by other threads while it is compressed come before it in the archive
+void big_files_do_not_hold_small_ones(const fs::path& work_dir)
+{
+   auto tree    = work_dir / "big_and_small";
+   auto archive = work_dir / "big_and_small.bttf";
+
+   std::mt19937_64 rng(19);
+
+   fs::remove_all(tree);
+
+   // every size is taken by two files of different content, so all of them are hashed first and
+   // then written in the order of their digests, the big files come somewhere among the small ones
+   const size_t BigSize = 16 * 1024 * 1024;
+
+   write_file(tree / "big" / "a.txt", make_text(rng, BigSize));
+   write_file(tree / "big" / "b.txt", make_text(rng, BigSize));
+
+   for (size_t i = 0; i < 1000; ++i)
+   {
+      auto size = 1024 + i;
+      write_file(tree / ("d" + std::to_string(i % 10)) / ("s" + std::to_string(i) + "a.txt"), make_text(rng, size));
+      write_file(tree / ("d" + std::to_string(i % 10)) / ("s" + std::to_string(i) + "b.txt"), make_text(rng, size));
+   }
+
+   bttf::g_config.compression_level = 9;
+   bttf::g_config.chunk_size        = 64 * 1024;
+
+   fs::remove(archive);
+   {
+      bttf::packer_t packer(tree, archive);
+   }
+
+   auto items = bttf::read_index(archive);
+   CHECK(items.size() == 2002, "the archive has " << items.size() << " entries");
+
+   // the order the files have been written in
+   std::sort(items.begin(), items.end(), [](const bttf::index_item_t& a, const bttf::index_item_t& b)
+      {
+         return std::make_pair(a.digest, a.size) < std::make_pair(b.digest, b.size);
+      });
+
+   size_t checked = 0;
+
+   for (size_t i = 0; i < items.size(); ++i)
+   {
+      const auto& big = items[i];
+
+      if (big.size != BigSize)
+         continue;
+
+      // the small files written after the big one starts, up to the other big one which may take the threads
+      size_t after = 0;
+      size_t before_big = 0;
+
+      for (size_t j = i + 1; j < items.size() && items[j].size != BigSize; ++j)
+      {
+         ++after;
+         if (items[j].offset < big.offset)
+            ++before_big;
+      }
+
+      if (after < 100)
+         continue;
+
+      ++checked;
+
+      // with the range of the big file reserved before its frames are compressed, only the ones written
+      // while it is read come before it
+      CHECK(before_big * 10 >= after * 9, "only " << before_big << " of " << after << " small files after '" << big.name
+         << "' have been written while it was compressed");
+   }
+   CHECK(checked > 0, "no big file is followed by enough small files");
+
+   check_unpacked(tree, archive, work_dir / "big_and_small.out");
+}
+
+// the hash cache keeps the entries of the files whose digests have been taken from it
+void hash_cache_is_kept(const fs::path& work_dir)
+{
+   auto tree    = work_dir / "hash_cache";
+   auto archive = work_dir / "hash_cache.bttf";
+   auto cache   = work_dir / "hash_cache.cache";
+
+   std::mt19937_64 rng(5);
+
+   fs::remove_all(tree);
+
+   // files of unique sizes are written at once, files of the same size are hashed before
+   for (size_t i = 0; i < 100; ++i)
+      write_file(tree / ("d" + std::to_string(i % 7)) / ("u" + std::to_string(i) + ".txt"), make_text(rng, 1000 + i * 10));
+
+   for (size_t i = 0; i < 100; ++i)
+      write_file(tree / ("d" + std::to_string(i % 7)) / ("p" + std::to_string(i) + ".txt"), make_text(rng, 500 + i % 20));
+
+   bttf::g_config.compression_level = 1;
+   bttf::g_config.hash_cache        = cache;
+
+   fs::remove(cache);
+
+   std::vector<uintmax_t> sizes;
+
+   for (int run = 0; run < 3; ++run)
+   {
+      fs::remove(archive);
+      {
+         bttf::packer_t packer(tree, archive);
+      }
+
+      CHECK(fs::exists(cache), "the cache is not saved by run " << run);
+      sizes.push_back(fs::file_size(cache));
+   }
+
+   CHECK(sizes[0] == sizes[1] && sizes[1] == sizes[2], "the cache takes " << sizes[0] << ", " << sizes[1] << ", " << sizes[2] << " bytes");
+
+   check_unpacked(tree, archive, work_dir / "hash_cache.out");
+}
+
+const std::map<std::string, std::function<void(const fs::path&)>> Tests = {
+   { "big_files_do_not_hold_small_ones", big_files_do_not_hold_small_ones },
+   { "hash_cache_is_kept",               hash_cache_is_kept },
+};
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+   std::string only;
+   std::string work_dir;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+
+      if (arg == "--work-dir" && i + 1 < argc)
+         work_dir = argv[++i];
+      else if (Tests.count(arg))
+         only = arg;
+      else
+      {
+         std::cerr << "unknown test '" << arg << "', the tests are:" << std::endl;
+         for (const auto& test : Tests)
+            std::cerr << "   " << test.first << std::endl;
+         return EXIT_FAILURE;
+      }
+   }
+
+   auto root = work_dir.empty() ? fs::temp_directory_path() / ("bttf-tests-" + bttf::make_uuid()) : fs::path(work_dir);
+
+   int failed = 0;
+
+   for (const auto& test : Tests)
+   {
+      if (!only.empty() && only != test.first)
+         continue;
+
+      // every test starts with the defaults of the command line tool
+      bttf::g_config = bttf::config_t();
+      bttf::g_config.severity_level = boost::log::trivial::warning;
+
+      try
+      {
+         fs::create_directories(root / test.first);
+         test.second(root / test.first);
+
+         std::cerr << test.first << ": ok" << std::endl;
+      }
+      catch (const std::exception& e)
+      {
+         std::cerr << test.first << ": FAILED " << e.what() << std::endl;
+         ++failed;
+      }
+   }
+
+   if (work_dir.empty())
+   {
+      boost::system::error_code ec;
+      fs::remove_all(root, ec);
+   }
+
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,6 +1,11 @@
 #include "unpacker.h"
+#include "index.h"
 #include "trace.h"
 #include "compress.h"
+#include "config.h"
+#include "utilities.h"
+#include "input_stream.h"
+#include "inflight_limit.h"
 
 #include <boost/filesystem/fstream.hpp>
 
@@ -15,42 +20,175 @@
 
 #include <vector>
 #include <map>
+#include <array>
+#include <atomic>
+#include <mutex>
 
 namespace fs = boost::filesystem;
 
 namespace bttf {
 
+// bigger files are decompressed by the stream straight to the file
+static const uint64_t MaxBufferedFileSize = 16 * 1024 * 1024;
+
+// smaller stored files are left to the batching writer
+static const uint64_t MinKernelCopySize = 64 * 1024;
+
+// data read from a stream and not written yet
+static const uint64_t MaxStreamInflight = 256 * 1024 * 1024;
+
+// bigger nodes of a stream are written piece by piece while they are read
+static const size_t StreamPieceSize = 1024 * 1024;
+
+// the frame is decompressed straight to its place in the mapped output file
+static void write_frame(boost::interprocess::file_mapping& mapping, const char* frame, uint64_t len, uint64_t offset, size_t size, const fs::path& path, phase_stats_t& phase)
+{
+   using namespace boost::interprocess;
+   try
+   {
+      phase_timer_t timer(phase, size);
+
+      mapped_region region(mapping, read_write, offset, size);
+
+      if (!uncompress_to_memory(frame, len, region.get_address(), size))
+      {
+         BTTF_ERROR() << "An error has occured while decompressing data of " << path;
+      }
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while writing the file " << path << ", :" << e.what();
+   }
+}
+
 unpacker_t::unpacker_t(fs::path archive, fs::path output_folder)
    : archive_(std::move(archive))
    , output_folder_(std::move(output_folder))
+   , tree_(output_folder_)
 {
-   if (!fs::exists(output_folder_))
-      fs::create_directories(output_folder_);
-
    unpack();
 }
 
-void unpacker_t::write_file(const file_node_t* item, const fs::path& path)
+void unpacker_t::write_file(const file_node_t* item, const output_entry_t& entry, std::shared_ptr<const void> keep)
+{
+   write_data(reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len, item->data_len, item->compressed, entry, std::move(keep));
+}
+
+// data of a file node, a single zstd frame or stored content
+void unpacker_t::write_data(const char* data, uint64_t data_len, bool compressed, const output_entry_t& entry, std::shared_ptr<const void> keep)
 {
    try
    {
-      if (!fs::exists(path.parent_path()))
-         fs::create_directories(path.parent_path());
-
-      auto data = reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len;
-      if (item->compressed)
+      if (compressed)
       {
-         if (!uncompress_to_file(data, item->data_len, path))
+         const dictionary_t* dictionary = nullptr;
+
+         if (auto id = frame_dictionary_id(data, data_len))
          {
-            BTTF_ERROR() << "An error has occured while decompressing data";
+            auto iter = dictionaries_.find(id);
+
+            if (iter == dictionaries_.end())
+               throw std::runtime_error("dictionary " + std::to_string(id) + " is not found in the archive");
+
+            dictionary = iter->second.get();
+         }
+
+         auto size = frame_content_size(data, data_len);
+
+         // a small file is decompressed to memory and handed to the batching writer as a whole
+         if (writer_->batched() && size && *size <= MaxBufferedFileSize)
+         {
+            auto buffer = std::make_shared<buffer_t>(*size);
+            {
+               phase_timer_t timer(stats_.decompress, buffer->size());
+
+               if (!uncompress_to_memory(data, data_len, buffer->data(), buffer->size(), dictionary))
+               {
+                  BTTF_ERROR() << "An error has occured while decompressing data";
+                  return;
+               }
+            }
+            stats_.file_sizes.add(buffer->size());
+
+            phase_timer_t timer(stats_.write, buffer->size());
+            writer_->write(entry, buffer->data(), buffer->size(), buffer);
+         }
+         else
+         {
+            output_handle_t file(tree_, entry);
+            uint64_t        written = 0;
+
+            // the writes are a part of the decompression here
+            phase_timer_t timer(stats_.decompress);
+
+            if (!uncompress_to_stream(data, data_len, [&file, &written](const char* data, size_t size) { file.write(data, size); written += size; }, dictionary))
+            {
+               BTTF_ERROR() << "An error has occured while decompressing data";
+            }
+            stats_.decompress.bytes += written;
+            stats_.file_sizes.add(written);
          }
       }
       else
+         write_stored(entry, data, data_len, std::move(keep));
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while writing the file " << tree_.path(entry) << ", :" << e.what();
+   }
+}
+
+void unpacker_t::write_stored(const output_entry_t& entry, const char* data, uint64_t size, std::shared_ptr<const void> keep)
+{
+   stats_.file_sizes.add(size);
+
+   phase_timer_t timer(stats_.write, size);
+
+   // data with an owner is decompressed, only the data of the mapped archive can be copied by the kernel
+   if (keep || (writer_->batched() && size < MinKernelCopySize))
+   {
+      writer_->write(entry, data, size, std::move(keep));
+      return;
+   }
+
+   output_handle_t file(tree_, entry);
+
+   // the data goes from the archive to the file without a copy in the process
+   if (file.copy_from(*archive_file_, data - archive_data_, size))
+      ++stats_.kernel_copies;
+   else
+      file.write(data, size);
+}
+
+void unpacker_t::write_chunked_file(boost::asio::thread_pool& pool, const file_node_t* item, const output_entry_t& entry)
+{
+   using namespace boost::interprocess;
+
+   auto path = tree_.path(entry);
+   try
+   {
+      auto data  = reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len;
+      auto table = reinterpret_cast<const frame_table_t*>(data);
+      auto refs  = frame_refs(item, archive_data_, archive_size_);
+
+      output_handle_t(tree_, entry).resize(table->size);
+
+      stats_.file_sizes.add(table->size);
+
+      auto mapping = std::make_shared<file_mapping>(path.string().c_str(), read_write);
+
+      for (uint32_t i = 0; i < table->frames; ++i)
       {
-         fs::ofstream ofs;
-         ofs.exceptions(std::ofstream::badbit);
-         ofs.open(path, std::ios::binary);
-         ofs.write(data, item->data_len);
+         uint64_t offset = uint64_t(i) * table->chunk_size;
+         size_t   size   = std::min<uint64_t>(table->chunk_size, table->size - offset);
+
+         stats_.frame_queue.push();
+
+         boost::asio::post(pool, [this, mapping, frame = archive_data_ + refs[i].offset, len = refs[i].len, offset, size, path]
+            {
+               stats_.frame_queue.pop();
+               write_frame(*mapping, frame, len, offset, size, path, stats_.decompress);
+            });
       }
    }
    catch (const std::exception& e)
@@ -59,69 +197,627 @@ void unpacker_t::write_file(const file_node_t* item, const fs::path& path)
    }
 }
 
+void unpacker_t::write_block(const file_node_t* block, const std::vector<solid_member_t>& members, std::shared_ptr<const void> keep)
+{
+   auto data   = reinterpret_cast<const char*>(block) + sizeof(file_node_t) + block->name_len;
+   auto header = reinterpret_cast<const solid_block_t*>(data);
+   auto frame  = data + sizeof(solid_block_t);
+
+   const char* content = frame;
+
+   // the block is decompressed once for all its members
+   if (block->compressed)
+   {
+      auto buffer = std::make_shared<buffer_t>(header->size);
+      {
+         phase_timer_t timer(stats_.decompress, buffer->size());
+
+         if (!uncompress_to_memory(frame, block->data_len - sizeof(solid_block_t), buffer->data(), buffer->size()))
+         {
+            BTTF_ERROR() << "An error has occured while decompressing data";
+            return;
+         }
+      }
+      content = buffer->data();
+      keep    = std::move(buffer);
+   }
+
+   for (const auto& member : members)
+   {
+      try
+      {
+         if (member.ref.offset + member.ref.size > header->size)
+            throw std::runtime_error("incorrect solid block reference");
+
+         write_stored(member.entry, content + member.ref.offset, member.ref.size, keep);
+      }
+      catch (const std::exception& e)
+      {
+         BTTF_ERROR() << "An error has occured while writing the file " << tree_.path(member.entry) << ", :" << e.what();
+      }
+   }
+}
+
+void unpacker_t::load_dictionary(const file_node_t* item)
+{
+   auto dictionary = std::make_shared<dictionary_t>(reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len, item->data_len);
+   dictionaries_[dictionary->id()] = dictionary;
+}
+
 void unpacker_t::unpack()
 {
    using namespace boost::interprocess;
    using namespace boost::asio;
 
-   file_mapping mapping(archive_.wstring().c_str(), read_only);
+   if (archive_ == "-")
+   {
+      unpack_stream();
+      return;
+   }
+
+   file_mapping mapping(archive_.string().c_str(), read_only);
    mapped_region region(mapping, read_only);
 
    const char* data = static_cast<char*>(region.get_address());
 
-   auto src = data;
-   auto end = data + region.get_size();
+   auto version = check_header(data, region.get_size());
 
-   if (!std::equal(src, src + FileHeader.size(), FileHeader.data()))
-      throw std::runtime_error("Input file is not a correct archive");
+   archive_data_ = data;
+   archive_size_ = region.get_size();
+   archive_file_.reset(new source_handle_t(archive_));
 
-   src += FileHeader.size();
+   if (version == LegacyFormatVersion)
+   {
+      unpack_legacy();
+      return;
+   }
 
    std::map<int, const file_node_t*> list_of_files;
 
-   thread_pool pool(4);
+   // every file is extracted once under its first name, other names are made from it later
+   std::map<const file_node_t*, std::vector<output_entry_t>> targets;
+   std::vector<const file_node_t*> sources;
 
-   while (src < end)
+   auto add_target = [this, &targets, &sources](const file_node_t* fitem, const std::string& name)
    {
-      auto item = reinterpret_cast<const node_hdr_t*>(src);
+      auto& names = targets[fitem];
+      if (names.empty())
+         sources.push_back(fitem);
+      names.push_back(tree_.add(name));
+   };
+
+   thread_pool pool;
+
+   // members of solid blocks are written when all of them are known
+   std::map<const file_node_t*, std::vector<solid_member_t>> blocks;
 
-      if (item->status == node_hdr_t::estatus::File)
+   auto post_file = [this, &pool, &blocks, data, &region](const file_node_t* fitem, const output_entry_t& entry)
+   {
+      if (fitem->solid)
       {
-         auto fitem = static_cast<const file_node_t*>(item);
+         auto ref = reinterpret_cast<const solid_ref_t*>(reinterpret_cast<const char*>(fitem) + sizeof(file_node_t) + fitem->name_len);
 
-         list_of_files[item->file_id] = fitem;
+         if (ref->block_offset < ArchiveHeaderSize || ref->block_offset + sizeof(file_node_t) + sizeof(solid_block_t) > region.get_size())
+            throw std::runtime_error("Incorrect structure of the archive");
 
-         auto oname = output_folder_ / fs::path(fitem->name, fitem->name + item->name_len);
+         auto block = reinterpret_cast<const file_node_t*>(data + ref->block_offset);
+
+         if (!block->block || ref->block_offset + sizeof(file_node_t) + block->name_len + block->data_len > region.get_size())
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         blocks[block].push_back({ *ref, entry });
+         return;
+      }
+
+      stats_.file_queue.push();
+
+      post(pool, [this, &pool, fitem, &entry]
+         {
+            stats_.file_queue.pop();
+
+            if (fitem->chunked)
+               write_chunked_file(pool, fitem, entry);
+            else
+               write_file(fitem, entry);
+         });
+   };
+
+   phase_timer_t index_timer(stats_.index);
+
+   auto footer = find_footer(data, region.get_size());
+
+   if (!footer)
+      throw std::runtime_error("Archive " + archive_.string() + " has no index");
+
+   // the index has only actual entries, replaced files are hidden and used as a source of links
+   auto items = parse_index(data + footer->index_offset, footer->index_size, footer->entries);
+
+   for (const auto& item : items)
+   {
+      if (item.status == node_hdr_t::estatus::File)
+      {
+         if (item.offset < ArchiveHeaderSize || item.offset + sizeof(file_node_t) + item.name.size() + item.data_len > footer->index_offset)
+            throw std::runtime_error("Incorrect structure of the archive index");
+
+         auto fitem = reinterpret_cast<const file_node_t*>(data + item.offset);
+
+         if (item.dictionary)
+            load_dictionary(fitem);
+         else
+            list_of_files[item.file_id] = fitem;
+      }
+   }
+
+   for (const auto& item : items)
+   {
+      if (item.hidden)
+         continue;
+
+      auto iter = list_of_files.find(item.file_id);
+
+      if (iter == list_of_files.end())
+         throw std::runtime_error("Incorrect structure of the archive");
+
+      add_target(iter->second, item.name);
+   }
+
+   index_timer.stop();
+
+   // no file is opened before its directory exists, so the file loop makes no directory calls
+   {
+      phase_timer_t timer(stats_.mkdir);
+      tree_.create();
+   }
+
+   BTTF_DEBUG() << "directories: " << tree_.dirs() - 1;
+
+   writer_ = make_file_writer(g_config.io_engine, tree_);
+
+   BTTF_DEBUG() << "io engine: " << writer_->name();
+
+   for (auto source : sources)
+      post_file(source, targets[source].front());
+
+   for (auto& block : blocks)
+   {
+      stats_.file_queue.push();
+
+      post(pool, [this, block = block.first, members = std::move(block.second)]
+         {
+            stats_.file_queue.pop();
+            write_block(block, members);
+         });
+   }
+   pool.join();
+
+   // the queued files refer to the mapped archive
+   writer_->flush();
+   writer_.reset();
+
+   BTTF_DEBUG() << "stored files copied in the kernel: " << stats_.kernel_copies;
+
+   std::vector<std::vector<output_entry_t>> names;
+   names.reserve(sources.size());
+
+   for (auto source : sources)
+      names.push_back(std::move(targets[source]));
+
+   write_links(names);
+}
+
+void unpacker_t::unpack_legacy()
+{
+   using namespace boost::asio;
+
+   phase_timer_t index_timer(stats_.index);
+
+   auto items = read_legacy_nodes(archive_data_, archive_size_);
+
+   // all names of every file, the first one is extracted and the others are made from it
+   std::vector<std::vector<output_entry_t>> names;
+   std::vector<const index_item_t*> sources;
+   std::map<int, size_t> file_names; // by file id
+
+   for (const auto& item : items)
+   {
+      if (item.status == node_hdr_t::estatus::File)
+      {
+         file_names[item.file_id] = names.size();
+         names.push_back({ tree_.add(item.name) });
+         sources.push_back(&item);
+         continue;
+      }
+
+      auto iter = file_names.find(item.file_id);
+
+      if (iter == file_names.end())
+         throw std::runtime_error("Incorrect structure of the archive");
+
+      names[iter->second].push_back(tree_.add(item.name));
+   }
 
-         post(pool, [this, fitem, oname = std::move(oname)]
+   index_timer.stop();
+
+   {
+      phase_timer_t timer(stats_.mkdir);
+      tree_.create();
+   }
+
+   writer_ = make_file_writer(g_config.io_engine, tree_);
+
+   BTTF_DEBUG() << "io engine: " << writer_->name() << ", the archive is of the format without a version";
+
+   {
+      thread_pool pool;
+
+      for (size_t i = 0; i < sources.size(); ++i)
+      {
+         stats_.file_queue.push();
+
+         post(pool, [this, item = sources[i], &entry = names[i].front()]
             {
-               write_file(fitem, oname);
+               stats_.file_queue.pop();
+               write_data(archive_data_ + item->offset + sizeof(legacy_file_node_t) + item->name.size(), item->data_len, item->compressed, entry, nullptr);
             });
+      }
+      pool.join();
+   }
+
+   // the queued files refer to the mapped archive
+   writer_->flush();
+   writer_.reset();
+
+   write_links(names);
+}
+
+void unpacker_t::unpack_stream()
+{
+   using namespace boost::asio;
+
+   input_stream_t in;
+
+   std::array<char, ArchiveHeaderSize> header;
+
+   if (!in.read(header.data(), header.size()))
+      throw std::runtime_error("Input stream is empty");
 
-         src += sizeof(file_node_t) + fitem->name_len + fitem->data_len;
+   if (check_header(header.data(), header.size()) == LegacyFormatVersion)
+      throw std::runtime_error("the archive is of the format without a version, it can be read from a file only");
+
+   // directories are created as the names come, every one once
+   {
+      phase_timer_t timer(stats_.mkdir);
+      tree_.create();
+   }
+
+   writer_ = make_file_writer(g_config.io_engine, tree_);
+
+   BTTF_DEBUG() << "io engine: " << writer_->name();
+
+   // the tasks release their bytes until the pool is joined, so the limit outlives it
+   inflight_limit_t inflight(MaxStreamInflight, stats_.inflight);
+   thread_pool pool;
+
+   // all names of every file, the first one is extracted and the others are made from it
+   std::vector<std::vector<output_entry_t>> names;
+   std::map<uint32_t, size_t> file_names; // by file id
+
+   // members follow their block, so only the last block is kept
+   uint64_t                       block_offset = 0;
+   std::shared_ptr<buffer_t>      block;
+   std::vector<solid_member_t>    members;
+
+   auto post_block = [this, &pool, &inflight, &block, &members]
+   {
+      if (block)
+      {
+         stats_.file_queue.push();
+
+         post(pool, [this, &inflight, block, members = std::move(members)]
+            {
+               stats_.file_queue.pop();
+               write_block(reinterpret_cast<const file_node_t*>(block->data()), members, block);
+               inflight.release(block->size());
+            });
       }
-      else if (item->status == node_hdr_t::estatus::Link)
+      block.reset();
+      members.clear();
+   };
+
+   auto add_name = [this, &names, &file_names](uint32_t file_id, const std::string& name)
+   {
+      auto entry = tree_.add(name);
+      file_names[file_id] = names.size();
+      names.push_back({ entry });
+      return entry;
+   };
+
+   for (;;)
+   {
+      uint64_t offset = in.position();
+
+      node_hdr_t hdr;
+      if (!in.read(&hdr, sizeof(hdr)))
+         throw std::runtime_error("the archive stream ends without the end node");
+
+      if (hdr.status == node_hdr_t::estatus::Link)
       {
-         auto litem = static_cast<const link_node_t*>(item);
+         std::string name(hdr.name_len, '\0');
+         in.read(&name[0], name.size());
 
-         auto iter = list_of_files.find(litem->file_id);
+         auto iter = file_names.find(hdr.file_id);
 
-         if (iter != list_of_files.end())
+         if (iter == file_names.end())
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         names[iter->second].push_back(tree_.add(name));
+         continue;
+      }
+
+      uint64_t data_len;
+      in.read(&data_len, sizeof(data_len));
+
+      // the index and the footer are the data of the end node
+      if (hdr.end)
+      {
+         in.skip(data_len);
+         break;
+      }
+
+      if (!hdr.solid)
+         post_block();
+
+      std::string name(hdr.name_len, '\0');
+      in.read(&name[0], name.size());
+
+      uint64_t node_size = sizeof(file_node_t) + name.size() + data_len;
+
+      // a big file is written by the reader while its data comes
+      if (!hdr.chunked && !hdr.block && !hdr.dictionary && data_len > MaxBufferedFileSize)
+      {
+         write_streamed_file(in, hdr, data_len, add_name(hdr.file_id, name));
+         continue;
+      }
+
+      auto buffer = std::make_shared<buffer_t>(node_size);
+
+      auto node = reinterpret_cast<file_node_t*>(buffer->data());
+      memcpy(static_cast<node_hdr_t*>(node), &hdr, sizeof(hdr));
+      node->data_len = data_len;
+      memcpy(node->name, name.data(), name.size());
+
+      {
+         phase_timer_t timer(stats_.read, data_len);
+         in.read(buffer->data() + sizeof(file_node_t) + name.size(), data_len);
+      }
+
+      if (hdr.dictionary)
+      {
+         load_dictionary(node);
+         continue;
+      }
+
+      if (hdr.block)
+      {
+         inflight.acquire(node_size);
+         block_offset = offset;
+         block = std::move(buffer);
+         continue;
+      }
+
+      auto entry = add_name(hdr.file_id, name);
+
+      if (hdr.solid)
+      {
+         auto ref = reinterpret_cast<const solid_ref_t*>(node->name + name.size());
+
+         if (!block || ref->block_offset != block_offset)
+            throw std::runtime_error("Incorrect structure of the archive");
+
+         members.push_back({ *ref, entry });
+         continue;
+      }
+
+      if (hdr.chunked)
+      {
+         write_stream_frames(in, pool, inflight, node, entry);
+         continue;
+      }
+
+      inflight.acquire(node_size);
+
+      stats_.file_queue.push();
+
+      post(pool, [this, &inflight, buffer, node, entry, node_size]
          {
-            auto oname = output_folder_ / fs::path(litem->name, litem->name + litem->name_len);
+            stats_.file_queue.pop();
+            write_file(node, entry, buffer);
+            inflight.release(node_size);
+         });
+   }
+   post_block();
 
-            post(pool, [this, fitem = iter->second, oname = std::move(oname)]
-               {
-                  write_file(fitem, oname);
-               });
+   // the parts of an appended archive follow each other, which of their files are replaced is known
+   // from the last index only; the rest is read to let the writer finish
+   char next;
+   if (in.read(&next, sizeof(next)))
+   {
+      in.drain();
+      throw std::runtime_error("the archive has been appended to, it can be read from a file only");
+   }
+
+   pool.join();
+
+   writer_->flush();
+   writer_.reset();
+
+   write_links(names);
+}
+
+void unpacker_t::write_streamed_file(input_stream_t& in, const node_hdr_t& hdr, uint64_t data_len, const output_entry_t& entry)
+{
+   buffer_t piece(StreamPieceSize);
+   uint64_t left    = data_len;
+   uint64_t written = 0;
+
+   try
+   {
+      output_handle_t file(tree_, entry);
+
+      std::unique_ptr<stream_decompressor_t> decompressor;
+
+      while (left > 0)
+      {
+         size_t size = static_cast<size_t>(std::min<uint64_t>(left, piece.size()));
+         {
+            phase_timer_t timer(stats_.read, size);
+            in.read(piece.data(), size);
          }
-         else
-            throw std::runtime_error("Incorrect structure of the archive");
+         left -= size;
 
-         src += sizeof(link_node_t) + litem->name_len;
+         if (!hdr.compressed)
+         {
+            phase_timer_t timer(stats_.write, size);
+            file.write(piece.data(), size);
+            written += size;
+            continue;
+         }
+
+         // the first piece has the frame header telling the dictionary
+         if (!decompressor)
+         {
+            const dictionary_t* dictionary = nullptr;
+
+            if (auto id = frame_dictionary_id(piece.data(), size))
+            {
+               auto iter = dictionaries_.find(id);
+
+               if (iter == dictionaries_.end())
+                  throw std::runtime_error("dictionary " + std::to_string(id) + " is not found in the archive");
+
+               dictionary = iter->second.get();
+            }
+            decompressor.reset(new stream_decompressor_t(dictionary));
+         }
+
+         // the writes are a part of the decompression here
+         phase_timer_t timer(stats_.decompress);
+
+         if (!decompressor->feed(piece.data(), size, [&file, &written](const char* data, size_t size) { file.write(data, size); written += size; }))
+            throw std::runtime_error("decompressing failed");
       }
+      stats_.decompress.bytes += hdr.compressed ? written : 0;
+      stats_.file_sizes.add(written);
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while writing the file " << tree_.path(entry) << ", :" << e.what();
+   }
+
+   // the stream goes on with the next node
+   in.skip(left);
+}
+
+void unpacker_t::write_stream_frames(input_stream_t& in, boost::asio::thread_pool& pool, inflight_limit_t& inflight, const file_node_t* item, const output_entry_t& entry)
+{
+   using namespace boost::interprocess;
+
+   auto data  = reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len;
+   auto table = reinterpret_cast<const frame_table_t*>(data);
+   auto path  = tree_.path(entry);
+
+   if (item->data_len < sizeof(frame_table_t) || table->chunk_size == 0 || uint64_t(table->frames) * table->chunk_size < table->size
+      || (table->frames > 0 && uint64_t(table->frames - 1) * table->chunk_size >= table->size))
+      throw std::runtime_error("incorrect frame table");
+
+   std::shared_ptr<file_mapping> mapping;
+
+   try
+   {
+      output_handle_t(tree_, entry).resize(table->size);
+
+      stats_.file_sizes.add(table->size);
+
+      mapping = std::make_shared<file_mapping>(path.string().c_str(), read_write);
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while writing the file " << path << ", :" << e.what();
+   }
+
+   for (uint32_t i = 0; i < table->frames; ++i)
+   {
+      inline_frame_t prefix;
+      in.read(&prefix, sizeof(prefix));
+
+      if (!mapping)
+      {
+         in.skip(prefix.len);
+         continue;
+      }
+
+      auto frame = std::make_shared<buffer_t>(prefix.len);
+      {
+         phase_timer_t timer(stats_.read, frame->size());
+         in.read(frame->data(), frame->size());
+      }
+
+      uint64_t offset = uint64_t(i) * table->chunk_size;
+      size_t   size   = std::min<uint64_t>(table->chunk_size, table->size - offset);
+
+      inflight.acquire(frame->size());
+
+      stats_.frame_queue.push();
+
+      boost::asio::post(pool, [this, &inflight, mapping, frame, offset, size, path]
+         {
+            stats_.frame_queue.pop();
+            write_frame(*mapping, frame->data(), frame->size(), offset, size, path, stats_.decompress);
+            inflight.release(frame->size());
+         });
+   }
+}
+
+void unpacker_t::write_links(const std::vector<std::vector<output_entry_t>>& files)
+{
+   auto mode = parse_link_mode(g_config.link_mode).value_or(link_mode_t::reflink);
+
+   std::array<std::atomic<size_t>, 4> done = {};
+
+   boost::asio::thread_pool pool;
+
+   stats_.files += files.size();
+
+   for (const auto& names : files)
+   {
+      if (names.size() < 2)
+         continue;
+
+      stats_.links += names.size() - 1;
+
+      boost::asio::post(pool, [this, &names, mode, &done]
+         {
+            phase_timer_t timer(stats_.link);
+
+            auto source = tree_.path(names.front());
+
+            for (auto iter = std::next(names.begin()); iter != names.end(); ++iter)
+            {
+               auto target = tree_.path(*iter);
+               try
+               {
+                  ++done[static_cast<size_t>(clone_file(source, target, mode))];
+               }
+               catch (const std::exception& e)
+               {
+                  BTTF_ERROR() << "An error has occured while writing the file " << target << ", :" << e.what();
+               }
+            }
+         });
    }
    pool.join();
+
+   BTTF_DEBUG() << "links: hardlinks " << done[0] << ", reflinks " << done[1] << ", range copies " << done[2] << ", copies " << done[3];
 }
 
 } // namespace bttf
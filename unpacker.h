@@ -1,23 +1,89 @@
 #pragma once
 
 #include "structure.h"
+#include "compress.h"
+#include "file_writer.h"
+#include "output_tree.h"
+#include "metrics.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <vector>
+#include <map>
+#include <atomic>
 
 namespace bttf {
 
+struct input_stream_t;
+struct inflight_limit_t;
+
+// where the time of unpacking goes, reported by --stats-json
+struct unpacker_stats_t
+{
+   std::atomic<size_t> files = 0;          // extracted once, other names are made by write_links
+   std::atomic<size_t> links = 0;
+   std::atomic<size_t> kernel_copies = 0;  // stored files copied from the archive in the kernel
+
+   phase_stats_t    index;       // reading of the index or the walk over the nodes
+   phase_stats_t    mkdir;
+   phase_stats_t    read;        // reading of the input stream
+   phase_stats_t    decompress;
+   phase_stats_t    write;       // writes, kernel copies and hand-over to the batching writer
+   phase_stats_t    link;
+   lock_stats_t     inflight;    // the stream reader waiting for the writing threads
+   queue_stats_t    file_queue;  // files and blocks waiting for a writing thread
+   queue_stats_t    frame_queue; // frames of big files waiting for a decompressing thread
+   size_histogram_t file_sizes;
+};
+
+// archive "-" is read from the standard input
 struct unpacker_t
 {
    unpacker_t(boost::filesystem::path archive, boost::filesystem::path output_folder);
 
+   const unpacker_stats_t& stats() const
+   {
+      return stats_;
+   }
+
 private:
+   struct solid_member_t
+   {
+      solid_ref_t    ref;
+      output_entry_t entry;
+   };
+
    void unpack();
+   void unpack_legacy();
+   void unpack_stream();
 
-   void write_file(const file_node_t* item, const boost::filesystem::path& path);
+   // keep holds the memory of the node if it is not in the mapped archive
+   void write_file(const file_node_t* item, const output_entry_t& entry, std::shared_ptr<const void> keep = nullptr);
+   void write_data(const char* data, uint64_t data_len, bool compressed, const output_entry_t& entry, std::shared_ptr<const void> keep);
+   void write_stored(const output_entry_t& entry, const char* data, uint64_t size, std::shared_ptr<const void> keep);
+   void write_chunked_file(boost::asio::thread_pool& pool, const file_node_t* item, const output_entry_t& entry);
+   void write_streamed_file(input_stream_t& in, const node_hdr_t& hdr, uint64_t data_len, const output_entry_t& entry);
+   void write_stream_frames(input_stream_t& in, boost::asio::thread_pool& pool, inflight_limit_t& inflight, const file_node_t* item, const output_entry_t& entry);
+   void write_block(const file_node_t* block, const std::vector<solid_member_t>& members, std::shared_ptr<const void> keep = nullptr);
+   void load_dictionary(const file_node_t* item);
+   void write_links(const std::vector<std::vector<output_entry_t>>& files);
 
 private:
    const boost::filesystem::path archive_;
    const boost::filesystem::path output_folder_;
+
+   output_tree_t tree_; // all directories are created before the first file
+
+   std::map<unsigned, dictionary_ptr> dictionaries_; // by zstd dictionary id, loaded before any file
+
+   const char* archive_data_ = nullptr; // mapped archive while unpacking
+   uint64_t    archive_size_ = 0;
+
+   std::unique_ptr<file_writer_t>   writer_;
+   std::unique_ptr<source_handle_t> archive_file_; // stored data is copied from it in the kernel
+
+   unpacker_stats_t stats_;
 };
 
 } // namespace bttf
@@ -1,14 +1,14 @@
 #include "utilities.h"
-#include "processor.h"
+#include "verifier.h"
 #include "trace.h"
+#include "crc32c.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 
-#include <boost/container_hash/hash.hpp>
-
 #include <boost/lexical_cast.hpp>
 
 #include <boost/uuid/uuid.hpp>
@@ -19,6 +19,22 @@
 #include <boost/asio/post.hpp>
 
 #include <map>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace fs = boost::filesystem;
 
@@ -26,99 +42,381 @@ namespace bttf {
 
 using namespace boost::interprocess;
 
-#if 1
+void release_pages(const void* data, size_t size)
+{
+#ifndef _WIN32
+   static const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+   // only the pages lying within the range as a whole, the edges may be shared with other pieces
+   auto begin = (reinterpret_cast<uintptr_t>(data) + page - 1) / page * page;
+   auto end   = (reinterpret_cast<uintptr_t>(data) + size) / page * page;
 
-size_t calc_checksum(const fs::path& file)
+   if (end > begin)
+      madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#else
+   // a view is trimmed from the working set when it is unmapped
+   (void)data;
+   (void)size;
+#endif
+}
+
+file_stat_t stat_file(const fs::path& file)
 {
+   file_stat_t result;
+
+#ifdef _WIN32
+   result.size  = fs::file_size(file);
+   result.mtime = static_cast<int64_t>(fs::last_write_time(file)) * 1000000000LL;
+#else
+   struct stat st;
+   if (::stat(file.c_str(), &st) != 0)
+      throw fs::filesystem_error("stat", file, boost::system::error_code(errno, boost::system::generic_category()));
+
+   result.size  = st.st_size;
+#ifdef __APPLE__
+   result.mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+   result.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+   result.inode = st.st_ino;
+   result.dev   = st.st_dev;
+   result.nlink = st.st_nlink;
+#endif
+
+   return result;
+}
+
+static digest_t hash_file(const fs::path& file)
+{
+   if (fs::file_size(file) == 0)
+      return hash_buffer(nullptr, 0);
+
    file_mapping mapping(file.string().c_str(), read_only);
    mapped_region region(mapping, read_only);
 
-   const char* data = static_cast<char*>(region.get_address());
-   std::size_t size = region.get_size();
+   auto data = static_cast<const char*>(region.get_address());
+   auto size = region.get_size();
 
-   return boost::hash_range(data, data + size);
+   hasher_t hasher;
+
+   for (size_t pos = 0; pos < size; pos += ReadPieceSize)
+   {
+      auto piece = std::min(ReadPieceSize, size - pos);
+
+      hasher.update(data + pos, piece);
+      release_pages(data + pos, piece);
+   }
+   return hasher.finish();
 }
 
-#else
+// the digest and the crc32c of the file in one pass
+static file_digest_t sum_file(const fs::path& file)
+{
+   file_digest_t sum;
+   sum.readable = true;
+
+   if (fs::file_size(file) == 0)
+   {
+      sum.digest = hash_buffer(nullptr, 0);
+      return sum;
+   }
+
+   file_mapping mapping(file.string().c_str(), read_only);
+   mapped_region region(mapping, read_only);
+
+   auto data = static_cast<const char*>(region.get_address());
+   auto size = region.get_size();
+
+   hasher_t hasher;
+
+   for (size_t pos = 0; pos < size; pos += ReadPieceSize)
+   {
+      auto piece = std::min(ReadPieceSize, size - pos);
+
+      hasher.update(data + pos, piece);
+      sum.crc = crc32c(data + pos, piece, sum.crc);
+      release_pages(data + pos, piece);
+   }
+   sum.digest = hasher.finish();
+   return sum;
+}
 
-// alternative implementation
 size_t calc_checksum(const fs::path& file)
 {
-   auto size = fs::file_size(file);
+   return static_cast<size_t>(hash_file(file)[0]);
+}
 
-   fs::ifstream ifs;
-   ifs.exceptions(std::ifstream::badbit);
-   ifs.open(file, std::ios::binary);
+digest_t calc_digest(const fs::path& file)
+{
+   return hash_file(file);
+}
+
+boost::optional<link_mode_t> parse_link_mode(const std::string& name)
+{
+   for (auto mode : { link_mode_t::hardlink, link_mode_t::reflink, link_mode_t::copy_range, link_mode_t::copy })
+   {
+      if (name == link_mode_name(mode))
+         return mode;
+   }
+   return boost::none;
+}
+
+const char* link_mode_name(link_mode_t mode)
+{
+   switch (mode)
+   {
+   case link_mode_t::hardlink:   return "hardlink";
+   case link_mode_t::reflink:    return "reflink";
+   case link_mode_t::copy_range: return "copy-range";
+   default:                      return "copy";
+   }
+}
+
+#ifdef __linux__
+
+struct unique_fd_t
+{
+   explicit unique_fd_t(int fd)
+      : fd(fd)
+   {
+   }
+
+   ~unique_fd_t()
+   {
+      if (fd >= 0)
+         ::close(fd);
+   }
 
-   const size_t BUF_SIZE = 256 * 1024ULL;
+   int fd;
+};
+
+// the data is shared or copied inside the kernel, nothing passes through the process
+static boost::optional<link_mode_t> clone_in_kernel(const fs::path& source, const fs::path& target, link_mode_t mode)
+{
+   unique_fd_t src(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+   if (src.fd < 0)
+      return boost::none;
+
+   struct stat st;
+   if (::fstat(src.fd, &st) != 0)
+      return boost::none;
+
+   unique_fd_t dst(::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+   if (dst.fd < 0)
+      return boost::none;
 
-   std::vector<char> buffer(BUF_SIZE);
-   auto remain = size;
+   if (mode <= link_mode_t::reflink && ::ioctl(dst.fd, FICLONE, src.fd) == 0)
+      return link_mode_t::reflink;
 
-   size_t hash = 0;
-   while (remain > 0)
+   uint64_t left = st.st_size;
+
+   while (left > 0)
    {
-      ifs.read(buffer.data(), std::min(remain, BUF_SIZE));
-      size_t read_bytes = ifs.gcount();
-      boost::hash_range(hash, buffer.data(), buffer.data() + read_bytes);
-      remain -= read_bytes;
+      auto res = ::copy_file_range(src.fd, nullptr, dst.fd, nullptr, left, 0);
+
+      if (res <= 0)
+         return boost::none;
+
+      left -= res;
    }
-   return hash;
+   return link_mode_t::copy_range;
 }
 
 #endif
 
+link_mode_t clone_file(const fs::path& source, const fs::path& target, link_mode_t mode)
+{
+   if (mode == link_mode_t::hardlink)
+   {
+      boost::system::error_code ec;
+
+      fs::remove(target, ec);
+      fs::create_hard_link(source, target, ec);
+
+      if (!ec)
+         return link_mode_t::hardlink;
+   }
+
+#ifdef __linux__
+   if (mode <= link_mode_t::copy_range)
+   {
+      if (auto done = clone_in_kernel(source, target, mode))
+         return *done;
+   }
+#endif
+
+   fs::ifstream ifs;
+   ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
+   ifs.open(source, std::ios::binary);
+
+   fs::ofstream ofs;
+   ofs.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+   ofs.open(target, std::ios::binary | std::ios::trunc);
+
+   if (fs::file_size(source) > 0)
+      ofs << ifs.rdbuf();
+
+   return link_mode_t::copy;
+}
+
 bool equal_files(const fs::path& a, const fs::path& b)
 {
+   if (fs::file_size(a) == 0)
+      return fs::file_size(b) == 0;
+
    file_mapping mapping_a(a.string().c_str(), read_only);
    mapped_region region_a(mapping_a, read_only);
 
    const char* addr_a = static_cast<char*>(region_a.get_address());
-   std::size_t size = region_a.get_size();  // files must have the same size
+   std::size_t size = region_a.get_size();
 
-   file_mapping mapping_b(a.string().c_str(), read_only);
+   file_mapping mapping_b(b.string().c_str(), read_only);
    mapped_region region_b(mapping_b, read_only);
 
+   if (region_b.get_size() != size)
+      return false;
+
    const char* addr_b = static_cast<char*>(region_b.get_address());
 
-   return std::equal(addr_a, addr_a + size, addr_b);
+   for (size_t pos = 0; pos < size; pos += ReadPieceSize)
+   {
+      auto piece = std::min(ReadPieceSize, size - pos);
+
+      if (!std::equal(addr_a + pos, addr_a + pos + piece, addr_b + pos))
+         return false;
+
+      release_pages(addr_a + pos, piece);
+      release_pages(addr_b + pos, piece);
+   }
+   return true;
 }
 
-boost::optional<size_t> calc_dir_checksum(const fs::path& dir)
+namespace {
+
+struct digest_dir_t
 {
-   try
+   digest_dir_t(fs::path p, fs::path r)
+      : path(std::move(p))
+      , rel(std::move(r))
    {
-      auto iterator = fs::recursive_directory_iterator(dir);
+   }
+
+   fs::path path;
+   fs::path rel;  // relative to the root
+   bool     listed = true;
 
-      std::map<std::string, bool> files_list;
+   std::vector<std::pair<fs::path, file_digest_t>> files;
+   std::vector<std::unique_ptr<digest_dir_t>>      dirs;
+};
 
-      for (const auto& iter : iterator)
+// every directory is listed by a separate task, then every file of it is hashed by a separate task
+void digest_dir(boost::asio::thread_pool& pool, digest_dir_t* dir)
+{
+   try
+   {
+      // the same entries the packer takes: regular files and directories which are not symlinks
+      for (const auto& entry : fs::directory_iterator(dir->path))
       {
-         if (fs::is_regular(iter) || fs::is_directory(iter))
-         {
-            const auto& file_name = iter.path();
-            files_list.insert({ fs::relative(file_name, dir).string(),fs::is_regular(iter) });
-         }
+         if (fs::is_directory(entry.symlink_status()))
+            dir->dirs.push_back(std::make_unique<digest_dir_t>(entry.path(), dir->rel / entry.path().filename()));
+         else if (fs::is_regular(entry.status()))
+            dir->files.push_back({ entry.path().filename(), file_digest_t{} });
       }
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "Exception in calc_dir_checksum(): " << e.what();
+      dir->listed = false;
+   }
 
-      size_t hash_value = 0;
+   std::sort(dir->files.begin(), dir->files.end(), [](const auto& a, const auto& b)
+      {
+         return a.first < b.first;
+      });
 
-      for (const auto& iter : files_list)
+   std::sort(dir->dirs.begin(), dir->dirs.end(), [](const auto& a, const auto& b)
       {
-         boost::hash_range(hash_value, iter.first.begin(), iter.first.end());
+         return a->path < b->path;
+      });
 
-         if (iter.second)
+   for (auto& file : dir->files)
+   {
+      boost::asio::post(pool, [dir, &file]
+         {
+            try
+            {
+               file.second = sum_file(dir->path / file.first);
+            }
+            catch (const std::exception& e)
+            {
+               BTTF_ERROR() << "Exception in calc_dir_checksum(): " << e.what();
+            }
+         });
+   }
+
+   for (auto& sub : dir->dirs)
+   {
+      boost::asio::post(pool, [&pool, sub = sub.get()]
          {
-            file_mapping mapping((dir / iter.first).string().c_str(), read_only);
-            mapped_region region(mapping, read_only);
+            digest_dir(pool, sub);
+         });
+   }
+}
+
+// digest of a directory is made of the names and digests of its files and subdirectories in name order
+// an unreadable entry is hashed by its name only and marked apart, so it never matches a readable one
+digest_t combine_dir(const digest_dir_t& dir, std::map<std::string, file_digest_t>& files)
+{
+   hasher_t hasher;
+
+   auto add = [&hasher](char kind, const fs::path& name, const digest_t& digest)
+   {
+      auto str = name.string();
+      hasher.update(&kind, 1);
+      hasher.update(str.data(), str.size() + 1);
+      hasher.update(digest.data(), sizeof(digest));
+   };
+
+   if (!dir.listed)
+   {
+      files[dir.rel.empty() ? std::string(".") : dir.rel.string()] = file_digest_t{};
+      add('u', fs::path(), digest_t{});
+   }
+
+   for (const auto& file : dir.files)
+   {
+      add(file.second.readable ? 'f' : 'u', file.first, file.second.digest);
+      files[(dir.rel / file.first).string()] = file.second;
+   }
+
+   for (const auto& sub : dir.dirs)
+      add('d', sub->path.filename(), combine_dir(*sub, files));
 
-            const char* data = static_cast<char*>(region.get_address());
+   return hasher.finish();
+}
+
+} // namespace
+
+boost::optional<dir_digest_t> calc_dir_checksum(const fs::path& dir)
+{
+   try
+   {
+      digest_dir_t root(dir, fs::path());
+
+      {
+         boost::asio::thread_pool pool;
+
+         boost::asio::post(pool, [&pool, &root]
+            {
+               digest_dir(pool, &root);
+            });
 
-            boost::hash_range(hash_value, data, data + region.get_size());
-         }
+         pool.join();
       }
 
-      return hash_value;
+      dir_digest_t result;
+      result.root = combine_dir(root, result.files);
+      return result;
    }
    catch (const std::exception& e)
    {
@@ -154,35 +452,15 @@ bool test_unpack(const fs::path& input, const fs::path& output)
 {
    try
    {
-      BTTF_DEBUG() << "unpacking output file...";
-
-      auto temp_dir = fs::temp_directory_path() / make_uuid();
+      BTTF_DEBUG() << "verifying output file...";
 
       time_period_t period;
 
-      bttf::unpack_file(output, temp_dir);
-
-      BTTF_DEBUG() << "unpacking takes " << period.in_ms() << " ms";
-
-      BTTF_DEBUG() << "comparing directories...";
-
-      boost::asio::thread_pool pool(2);
-      boost::optional<size_t> hash_i = 0;
-      boost::optional<size_t> hash_o = 0;
-
-      boost::asio::post(pool, [&hash_i, input]    { hash_i = calc_dir_checksum(input);    });
-      boost::asio::post(pool, [&hash_o, temp_dir] { hash_o = calc_dir_checksum(temp_dir); });
+      auto result = verify_folder(output, input);
 
-      pool.join();
-
-      BTTF_DEBUG() << "comparing takes " << period.in_ms() << " ms";
-
-      fs::remove_all(temp_dir);
-
-      if (!hash_i || !hash_o)
-         return false;
+      BTTF_DEBUG() << "verifying takes " << period.in_ms() << " ms";
 
-      return (hash_i == hash_o);
+      return result;
    }
    catch (const std::exception& e)
    {
@@ -1,15 +1,70 @@
 #pragma once
 
+#include "hash.h"
+
 #include <boost/optional.hpp>
 #include <boost/filesystem/path.hpp>
 
+#include <string>
+#include <map>
+
 namespace bttf {
 
+struct file_stat_t
+{
+   uint64_t size  = 0;
+   int64_t  mtime = 0; // ns since epoch where the filesystem provides it
+   uint64_t inode = 0; // 0 where it is not available
+   uint64_t dev   = 0;
+   uint64_t nlink = 1;
+};
+
+file_stat_t stat_file(const boost::filesystem::path& file);
+
 size_t calc_checksum(const boost::filesystem::path& file);
 
+// 128-bit content digest, strong enough to detect duplicates without comparing them
+digest_t calc_digest(const boost::filesystem::path& file);
+
 bool equal_files(const boost::filesystem::path& a, const boost::filesystem::path& b);
 
-boost::optional<size_t> calc_dir_checksum(const boost::filesystem::path& dir);
+// big files are read by pieces of this size, the pages of every read piece are dropped
+static const size_t ReadPieceSize = 4 * 1024 * 1024;
+
+// drops the pages of a read-only mapped range that has been read, they are read again
+// from the file if they are touched later; big files don't stay resident while they are processed
+void release_pages(const void* data, size_t size);
+
+// how copies of a file extracted once are made, every mode falls back to the following ones
+enum class link_mode_t
+{
+   hardlink, reflink, copy_range, copy
+};
+
+boost::optional<link_mode_t> parse_link_mode(const std::string& name);
+
+const char* link_mode_name(link_mode_t mode);
+
+// makes target the same as the already written source, returns the mode it has been done by
+link_mode_t clone_file(const boost::filesystem::path& source, const boost::filesystem::path& target, link_mode_t mode);
+
+struct file_digest_t
+{
+   bool     readable = false; // false if the file or the directory listing it can't be read
+   digest_t digest = {};
+   uint32_t crc = 0;          // crc32c, unrelated to the digest, so a collision of one of them is still caught
+};
+
+struct dir_digest_t
+{
+   digest_t                             root = {}; // the same for the same names and content of the files
+   std::map<std::string, file_digest_t> files;     // by path relative to the directory, unreadable directories too
+};
+
+// files are hashed in parallel and combined Merkle style: every directory is hashed from the names
+// and digests of its entries in name order, so the result doesn't depend on the order of hashing.
+// a file or a directory which can't be read is logged and marked in the files, the rest is still hashed
+boost::optional<dir_digest_t> calc_dir_checksum(const boost::filesystem::path& dir);
 
 std::string make_uuid();
 
@@ -0,0 +1,655 @@
+#include "verifier.h"
+#include "index.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "utilities.h"
+#include "trace.h"
+
+#include <boost/filesystem.hpp>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstring>
+
+namespace fs = boost::filesystem;
+
+namespace bttf {
+
+namespace {
+
+// what is taken from the original content of the files
+enum class sum_kind_t
+{
+   source, // the digest and the crc, to be compared with the source files
+   crc     // to be compared with the index
+};
+
+struct content_sum_t
+{
+   bool     valid = false; // false if the content can't be read
+   digest_t digest = {};
+   uint32_t crc = 0;
+};
+
+// the content is handed over piece by piece in its order
+struct accumulator_t
+{
+   explicit accumulator_t(sum_kind_t kind)
+      : kind_(kind)
+   {
+   }
+
+   void update(const char* data, size_t size)
+   {
+      if (kind_ == sum_kind_t::source)
+         hasher_.update(data, size);
+
+      crc_ = crc32c(data, size, crc_);
+   }
+
+   content_sum_t finish() const
+   {
+      content_sum_t sum;
+      sum.valid = true;
+      sum.crc   = crc_;
+
+      if (kind_ == sum_kind_t::source)
+         sum.digest = hasher_.finish();
+
+      return sum;
+   }
+
+private:
+   const sum_kind_t kind_;
+   hasher_t         hasher_;
+   uint32_t         crc_ = 0;
+};
+
+// sums of the content of the nodes of a mapped archive, nodes are decompressed in memory and nothing is written
+struct archive_reader_t
+{
+   archive_reader_t(const char* data, uint64_t size, sum_kind_t kind)
+      : data_(data)
+      , size_(size)
+      , kind_(kind)
+   {
+      if (check_header(data_, size_) == LegacyFormatVersion)
+         throw std::runtime_error("the archive is of the format without a version, it has no index and no checksums to check");
+
+      auto footer = find_footer(data_, size_);
+      if (!footer)
+         throw std::runtime_error("the archive has no index");
+
+      footer_ = *footer;
+   }
+
+   std::vector<index_item_t> read_index() const
+   {
+      return parse_index(data_ + footer_.index_offset, footer_.index_size, footer_.entries);
+   }
+
+   // node of a file entry of the index, throws if it is out of the archive
+   const file_node_t* node(const index_item_t& item) const
+   {
+      if (item.offset < ArchiveHeaderSize || item.offset + sizeof(file_node_t) + item.name.size() + item.data_len > footer_.index_offset)
+         throw std::runtime_error("Incorrect structure of the archive index");
+
+      return reinterpret_cast<const file_node_t*>(data_ + item.offset);
+   }
+
+   bool in_archive(const file_node_t* item) const
+   {
+      uint64_t offset = reinterpret_cast<const char*>(item) - data_;
+      return offset + sizeof(file_node_t) + item->name_len + item->data_len <= footer_.index_offset;
+   }
+
+   void load_dictionary(const file_node_t* item)
+   {
+      auto dictionary = std::make_shared<dictionary_t>(node_data(item), item->data_len);
+      dictionaries_[dictionary->id()] = dictionary;
+   }
+
+   // the content of the node is summed once whatever number of entries refer to it
+   void add(const file_node_t* item)
+   {
+      sums_[item];
+   }
+
+   // the sums are ready when the pool is joined and finish() is called
+   void post(boost::asio::thread_pool& pool);
+   void finish();
+
+   const content_sum_t& sum(const file_node_t* item) const { return sums_.at(item); }
+
+   // the original content of a file node piece by piece in its order, false if it can't be read
+   bool read_content(const file_node_t* item, const uncompress_sink_t& sink) const;
+
+private:
+   struct member_t
+   {
+      solid_ref_t    ref;
+      content_sum_t* sum;
+   };
+
+   content_sum_t sum_file(const file_node_t* item) const;
+   content_sum_t sum_frame(const frame_ref_t& ref, size_t size) const;
+   void          sum_block(const file_node_t* block, const std::vector<member_t>& members) const;
+   void          post_frames(boost::asio::thread_pool& pool, const file_node_t* item);
+
+   const char* node_data(const file_node_t* item) const
+   {
+      return reinterpret_cast<const char*>(item) + sizeof(file_node_t) + item->name_len;
+   }
+
+   static std::string node_name(const file_node_t* item)
+   {
+      return std::string(item->name, item->name_len);
+   }
+
+private:
+   const char*      data_;
+   const uint64_t   size_;
+   const sum_kind_t kind_;
+   footer_t         footer_;
+
+   std::map<unsigned, dictionary_ptr>                        dictionaries_;
+   std::map<const file_node_t*, content_sum_t>               sums_;   // filled by the pool
+   std::map<const file_node_t*, std::vector<content_sum_t>>  frames_; // crcs of frames summed apart
+};
+
+void archive_reader_t::post(boost::asio::thread_pool& pool)
+{
+   // members of a solid block are summed together, the block is decompressed once
+   std::map<const file_node_t*, std::vector<member_t>> blocks;
+
+   for (auto& sum : sums_)
+   {
+      auto fitem = sum.first;
+
+      if (fitem->solid)
+      {
+         auto ref = reinterpret_cast<const solid_ref_t*>(node_data(fitem));
+
+         if (ref->block_offset < ArchiveHeaderSize || ref->block_offset + sizeof(file_node_t) + sizeof(solid_block_t) > footer_.index_offset)
+         {
+            BTTF_ERROR() << "incorrect solid block reference of the file " << node_name(fitem);
+            continue;
+         }
+
+         auto block = reinterpret_cast<const file_node_t*>(data_ + ref->block_offset);
+
+         if (!block->block || !in_archive(block))
+         {
+            BTTF_ERROR() << "incorrect solid block reference of the file " << node_name(fitem);
+            continue;
+         }
+
+         blocks[block].push_back({ *ref, &sum.second });
+         continue;
+      }
+
+      // crcs of frames are combined, so the frames of a big file are checked in parallel
+      if (fitem->chunked && kind_ == sum_kind_t::crc)
+      {
+         post_frames(pool, fitem);
+         continue;
+      }
+
+      boost::asio::post(pool, [this, fitem, result = &sum.second]
+         {
+            *result = sum_file(fitem);
+         });
+   }
+
+   for (auto& block : blocks)
+   {
+      boost::asio::post(pool, [this, block = block.first, members = std::move(block.second)]
+         {
+            sum_block(block, members);
+         });
+   }
+}
+
+void archive_reader_t::post_frames(boost::asio::thread_pool& pool, const file_node_t* item)
+{
+   try
+   {
+      auto table = reinterpret_cast<const frame_table_t*>(node_data(item));
+      auto refs  = frame_refs(item, data_, size_);
+
+      if (table->chunk_size == 0 || table->frames != (table->size + table->chunk_size - 1) / table->chunk_size)
+         throw std::runtime_error("incorrect frame table");
+
+      auto& frames = frames_[item];
+      frames.resize(table->frames);
+
+      for (uint32_t i = 0; i < table->frames; ++i)
+      {
+         uint64_t offset = uint64_t(i) * table->chunk_size;
+         size_t   size   = std::min<uint64_t>(table->chunk_size, table->size - offset);
+
+         boost::asio::post(pool, [this, ref = refs[i], size, result = &frames[i]]
+            {
+               *result = sum_frame(ref, size);
+            });
+      }
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while reading the file " << node_name(item) << " : " << e.what();
+   }
+}
+
+void archive_reader_t::finish()
+{
+   for (auto& file : frames_)
+   {
+      auto table = reinterpret_cast<const frame_table_t*>(node_data(file.first));
+
+      content_sum_t sum;
+      sum.valid = true;
+
+      for (uint32_t i = 0; i < file.second.size() && sum.valid; ++i)
+      {
+         uint64_t offset = uint64_t(i) * table->chunk_size;
+         uint64_t size   = std::min<uint64_t>(table->chunk_size, table->size - offset);
+
+         sum.valid = file.second[i].valid;
+         sum.crc   = crc32c_combine(sum.crc, file.second[i].crc, size);
+      }
+      sums_.at(file.first) = sum;
+   }
+   frames_.clear();
+}
+
+content_sum_t archive_reader_t::sum_file(const file_node_t* item) const
+{
+   accumulator_t accumulator(kind_);
+
+   if (read_content(item, [&accumulator](const char* data, size_t size) { accumulator.update(data, size); }))
+      return accumulator.finish();
+
+   return content_sum_t();
+}
+
+bool archive_reader_t::read_content(const file_node_t* item, const uncompress_sink_t& sink) const
+{
+   try
+   {
+      if (!in_archive(item))
+         throw std::runtime_error("the data is out of the archive");
+
+      auto data = node_data(item);
+
+      if (item->solid)
+      {
+         auto ref = reinterpret_cast<const solid_ref_t*>(data);
+
+         if (ref->block_offset < ArchiveHeaderSize || ref->block_offset + sizeof(file_node_t) + sizeof(solid_block_t) > footer_.index_offset)
+            throw std::runtime_error("incorrect solid block reference");
+
+         auto block = reinterpret_cast<const file_node_t*>(data_ + ref->block_offset);
+
+         if (!block->block || !in_archive(block))
+            throw std::runtime_error("incorrect solid block reference");
+
+         auto header = reinterpret_cast<const solid_block_t*>(node_data(block));
+         auto frame  = node_data(block) + sizeof(solid_block_t);
+
+         if (ref->offset + ref->size > header->size || (!block->compressed && header->size + sizeof(solid_block_t) > block->data_len))
+            throw std::runtime_error("incorrect solid block reference");
+
+         if (!block->compressed)
+         {
+            sink(frame + ref->offset, ref->size);
+            return true;
+         }
+
+         buffer_t buffer(header->size);
+
+         if (!uncompress_to_memory(frame, block->data_len - sizeof(solid_block_t), buffer.data(), buffer.size()))
+            return false;
+
+         sink(buffer.data() + ref->offset, ref->size);
+         return true;
+      }
+
+      if (item->chunked)
+      {
+         auto table = reinterpret_cast<const frame_table_t*>(data);
+         auto refs  = frame_refs(item, data_, size_);
+
+         if (table->chunk_size == 0 || table->frames != (table->size + table->chunk_size - 1) / table->chunk_size)
+            throw std::runtime_error("incorrect frame table");
+
+         // frames are read in order, one of them is in memory at a time
+         buffer_t buffer(std::min<uint64_t>(table->chunk_size, table->size));
+
+         for (uint32_t i = 0; i < table->frames; ++i)
+         {
+            uint64_t offset = uint64_t(i) * table->chunk_size;
+            size_t   size   = std::min<uint64_t>(table->chunk_size, table->size - offset);
+
+            if (!uncompress_to_memory(data_ + refs[i].offset, refs[i].len, buffer.data(), size))
+               return false;
+
+            sink(buffer.data(), size);
+         }
+         return true;
+      }
+
+      if (!item->compressed)
+      {
+         sink(data, item->data_len);
+         return true;
+      }
+
+      const dictionary_t* dictionary = nullptr;
+
+      if (auto id = frame_dictionary_id(data, item->data_len))
+      {
+         auto iter = dictionaries_.find(id);
+
+         if (iter == dictionaries_.end())
+            throw std::runtime_error("dictionary " + std::to_string(id) + " is not found in the archive");
+
+         dictionary = iter->second.get();
+      }
+
+      return uncompress_to_stream(data, item->data_len, sink, dictionary);
+   }
+   catch (const std::exception& e)
+   {
+      BTTF_ERROR() << "An error has occured while reading the file " << node_name(item) << " : " << e.what();
+   }
+   return false;
+}
+
+content_sum_t archive_reader_t::sum_frame(const frame_ref_t& ref, size_t size) const
+{
+   buffer_t      buffer(size);
+   accumulator_t accumulator(kind_);
+
+   if (!uncompress_to_memory(data_ + ref.offset, ref.len, buffer.data(), size))
+      return content_sum_t();
+
+   accumulator.update(buffer.data(), size);
+   return accumulator.finish();
+}
+
+void archive_reader_t::sum_block(const file_node_t* block, const std::vector<member_t>& members) const
+{
+   auto data   = node_data(block);
+   auto header = reinterpret_cast<const solid_block_t*>(data);
+   auto frame  = data + sizeof(solid_block_t);
+
+   const char* content = frame;
+   buffer_t    buffer;
+
+   if (block->compressed)
+   {
+      buffer = buffer_t(header->size);
+
+      if (!uncompress_to_memory(frame, block->data_len - sizeof(solid_block_t), buffer.data(), buffer.size()))
+      {
+         BTTF_ERROR() << "An error has occured while decompressing data";
+         return;
+      }
+      content = buffer.data();
+   }
+   else if (header->size + sizeof(solid_block_t) > block->data_len)
+   {
+      BTTF_ERROR() << "incorrect size of a solid block";
+      return;
+   }
+
+   for (const auto& member : members)
+   {
+      if (member.ref.offset + member.ref.size > header->size)
+         continue;
+
+      accumulator_t accumulator(kind_);
+      accumulator.update(content + member.ref.offset, member.ref.size);
+      *member.sum = accumulator.finish();
+   }
+}
+
+} // namespace
+
+bool verify_folder(const fs::path& archive, const fs::path& folder)
+{
+   using namespace boost::interprocess;
+
+   file_mapping mapping(archive.string().c_str(), read_only);
+   mapped_region region(mapping, read_only);
+
+   archive_reader_t reader(static_cast<const char*>(region.get_address()), region.get_size(), sum_kind_t::source);
+
+   auto items = reader.read_index();
+
+   std::map<int, const file_node_t*> files;
+
+   for (const auto& item : items)
+   {
+      if (item.status != node_hdr_t::estatus::File)
+         continue;
+
+      if (item.dictionary)
+         reader.load_dictionary(reader.node(item));
+      else
+         files[item.file_id] = reader.node(item);
+   }
+
+   // names of the actual entries and the nodes they are made from
+   std::map<std::string, const file_node_t*> archive_names;
+
+   for (const auto& item : items)
+   {
+      if (item.hidden)
+         continue;
+
+      auto iter = files.find(item.file_id);
+
+      if (iter == files.end())
+         throw std::runtime_error("Incorrect structure of the archive");
+
+      archive_names[item.name] = iter->second;
+      reader.add(iter->second);
+   }
+
+   // both sides are hashed at the same time, the folder by its own pool
+   boost::optional<dir_digest_t> source;
+   {
+      boost::asio::thread_pool pool;
+
+      reader.post(pool);
+
+      source = calc_dir_checksum(folder);
+
+      pool.join();
+   }
+   reader.finish();
+
+   if (!source)
+      throw std::runtime_error("the source folder can't be read");
+
+   const auto& folder_files = source->files;
+
+   // both lists are sorted by name, the first difference is the first mismatching path
+   size_t mismatches = 0;
+
+   auto report = [&mismatches](const std::string& name, const char* reason)
+   {
+      if (mismatches++ == 0)
+         BTTF_ERROR() << "first mismatching path: " << name << " (" << reason << ")";
+   };
+
+   auto a = archive_names.begin();
+   auto f = folder_files.begin();
+
+   while (a != archive_names.end() || f != folder_files.end())
+   {
+      if (f == folder_files.end() || (a != archive_names.end() && a->first < f->first))
+      {
+         report(a->first, "not found in the folder");
+         ++a;
+      }
+      else if (a == archive_names.end() || f->first < a->first)
+      {
+         report(f->first, f->second.readable ? "not found in the archive" : "can't be read in the folder");
+         ++f;
+      }
+      else
+      {
+         const auto& sum = reader.sum(a->second);
+
+         if (!f->second.readable)
+            report(a->first, "can't be read in the folder");
+         else if (!sum.valid || sum.digest != f->second.digest || sum.crc != f->second.crc)
+            report(a->first, "content differs");
+         ++a;
+         ++f;
+      }
+   }
+
+   BTTF_DEBUG() << "verified files: " << archive_names.size() << ", mismatches: " << mismatches;
+
+   return mismatches == 0;
+}
+
+struct archive_content_t::impl_t
+{
+   explicit impl_t(const fs::path& archive)
+      : mapping(archive.string().c_str(), boost::interprocess::read_only)
+      , region(mapping, boost::interprocess::read_only)
+      , reader(static_cast<const char*>(region.get_address()), region.get_size(), sum_kind_t::crc)
+   {
+      for (const auto& item : reader.read_index())
+      {
+         if (item.dictionary)
+            reader.load_dictionary(reader.node(item));
+      }
+   }
+
+   boost::interprocess::file_mapping  mapping;
+   boost::interprocess::mapped_region region;
+   archive_reader_t                   reader;
+};
+
+archive_content_t::archive_content_t(const fs::path& archive)
+   : impl_(new impl_t(archive))
+{
+}
+
+archive_content_t::~archive_content_t() = default;
+
+bool archive_content_t::equal(const index_item_t& item, const char* data, uint64_t size) const
+{
+   if (item.status != node_hdr_t::estatus::File || item.size != size)
+      return false;
+
+   uint64_t pos  = 0;
+   bool     same = true;
+
+   auto sink = [data, size, &pos, &same](const char* piece, size_t piece_size)
+   {
+      same = same && pos + piece_size <= size && (piece_size == 0 || memcmp(data + pos, piece, piece_size) == 0);
+      pos += piece_size;
+   };
+
+   return impl_->reader.read_content(impl_->reader.node(item), sink) && same && pos == size;
+}
+
+bool verify_archive(const fs::path& archive)
+{
+   using namespace boost::interprocess;
+
+   auto start = std::chrono::steady_clock::now();
+
+   file_mapping mapping(archive.string().c_str(), read_only);
+   mapped_region region(mapping, read_only);
+
+   archive_reader_t reader(static_cast<const char*>(region.get_address()), region.get_size(), sum_kind_t::crc);
+
+   auto items = reader.read_index();
+
+   // every node of a file or a dictionary is checked, the replaced ones too since they are sources of links
+   std::vector<std::pair<const index_item_t*, const file_node_t*>> entries;
+
+   size_t   corrupted = 0;
+   uint64_t content_size = 0;
+
+   auto report = [&corrupted](const index_item_t& item, const char* reason)
+   {
+      ++corrupted;
+      BTTF_ERROR() << "corrupted entry: " << (item.dictionary ? std::string("<dictionary>") : item.name) << " (" << reason << ")";
+   };
+
+   for (const auto& item : items)
+   {
+      if (item.status != node_hdr_t::estatus::File)
+         continue;
+
+      auto fitem = reader.node(item);
+
+      // the node header must be the one the index refers to
+      if (fitem->status != node_hdr_t::estatus::File || fitem->file_id != uint32_t(item.file_id)
+         || fitem->name_len != item.name.size() || !std::equal(item.name.begin(), item.name.end(), fitem->name)
+         || !reader.in_archive(fitem))
+      {
+         report(item, "node header differs from the index");
+         continue;
+      }
+
+      if (item.dictionary)
+      {
+         try
+         {
+            reader.load_dictionary(fitem);
+         }
+         catch (const std::exception& e)
+         {
+            report(item, "dictionary can't be loaded");
+            continue;
+         }
+      }
+
+      reader.add(fitem);
+      entries.push_back({ &item, fitem });
+      content_size += item.size;
+   }
+
+   {
+      boost::asio::thread_pool pool;
+      reader.post(pool);
+      pool.join();
+   }
+   reader.finish();
+
+   for (const auto& entry : entries)
+   {
+      const auto& sum = reader.sum(entry.second);
+
+      if (!sum.valid)
+         report(*entry.first, "content can't be read");
+      else if (sum.crc != entry.first->crc)
+         report(*entry.first, "crc32c differs");
+   }
+
+   auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+   BTTF_DEBUG() << "crc32c engine: " << crc32c_engine_name();
+   BTTF_INFO() << "verified entries: " << entries.size() << ", content: " << content_size / (1024 * 1024) << " MB"
+      << ", " << (ms > 0 ? content_size / 1024 * 1000 / 1024 / ms : 0) << " MB/s, corrupted: " << corrupted;
+
+   return corrupted == 0;
+}
+
+} // namespace bttf
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "index.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <memory>
+
+namespace bttf {
+
+// compares every file of the archive with the same file of the folder it has been made from;
+// entries are decompressed in memory and compared by the digest and the crc32c, two unrelated functions,
+// so a digest collision that linked different files doesn't pass; nothing is written to the disk.
+// the first mismatching path in name order is reported, returns false if there is any
+bool verify_folder(const boost::filesystem::path& archive, const boost::filesystem::path& folder);
+
+// checks the crc32c of every file and dictionary node against the index without the source folder,
+// every corrupted entry is reported, returns false if there is any
+bool verify_archive(const boost::filesystem::path& archive);
+
+// the file entries of an archive compared with data in memory byte for byte, so new files are linked
+// to the content already in the archive only if it is the same; the entries are decompressed in memory
+struct archive_content_t : boost::noncopyable
+{
+   // the archive stays mapped, only its part up to the end of the index is read
+   explicit archive_content_t(const boost::filesystem::path& archive);
+   ~archive_content_t();
+
+   // item is a file entry of the index of the archive, safe to call from many threads
+   bool equal(const index_item_t& item, const char* data, uint64_t size) const;
+
+private:
+   struct impl_t;
+   std::unique_ptr<impl_t> impl_;
+};
+
+} // namespace bttf